@@ -2,8 +2,12 @@
 import subprocess
 from itertools import product
 
+import os
 import re
+import signal
+import struct
 import sys
+import time
 from io import StringIO
 
 import pytest
@@ -74,6 +78,34 @@ def read_err(tmpdir):
         return list(f)
 
 
+def read_binary_out(tmpdir):
+    """Text lines and decoded binary results, in order: (header, rows) for results."""
+    data = (tmpdir / "out").read_binary()
+    results = []
+    pos = 0
+    while pos < len(data):
+        if data.startswith(b"PLTB", pos):
+            columns_count, = struct.unpack_from("<I", data, pos + 4)
+            pos += 8
+            header = []
+            for _ in range(columns_count):
+                length, = struct.unpack_from("<I", data, pos)
+                header.append(data[pos + 4:pos + 4 + length].decode())
+                pos += 4 + length
+            rows_count, = struct.unpack_from("<Q", data, pos)
+            pos += 8
+            columns = []
+            for _ in range(columns_count):
+                columns.append(struct.unpack_from("<%dq" % rows_count, data, pos))
+                pos += 8 * rows_count
+            results.append((header, [list(row) for row in zip(*columns)]))
+        else:
+            end = data.index(b"\n", pos)
+            results.append(data[pos:end].decode())
+            pos = end + 1
+    return results
+
+
 def extract_results(lines):
     results = []
     current_result = []
@@ -155,10 +187,10 @@ def test_extract_results():
 
 
 # noinspection PyShadowingNames
-def call_planty_db(tmpdir, plantydb):
-    return subprocess.run("{plantydb} {csv} < {inp} 1> {out} 2> {err}".format(
-        plantydb=plantydb, csv=tmpdir / "csv", inp=tmpdir / "in", out=tmpdir / "out",
-        err=tmpdir / "err"), shell=True).returncode
+def call_planty_db(tmpdir, plantydb, options="", tables=()):
+    return subprocess.run("{plantydb} {options} {csv} {tables} < {inp} 1> {out} 2> {err}".format(
+        plantydb=plantydb, options=options, csv=tmpdir / "csv", tables=" ".join(str(t) for t in tables),
+        inp=tmpdir / "in", out=tmpdir / "out", err=tmpdir / "err"), shell=True).returncode
 
 
 @pytest.mark.parametrize("test_input,key_len,intervals_reversed",
@@ -270,6 +302,707 @@ def test_select(tmpdir, plantydb):
             ] == extract_results(read_out(tmpdir))
 
 
+def test_row_store(tmpdir, plantydb):
+    cols = ["a", "b", "c"]
+    write_csv(tmpdir, make_csv(cols, [[1, 2, 3], [4, 5, 6]], 1))
+    write_queries(tmpdir, [
+        "select a",
+        "select c, b, a where a=4",
+        "select *, a",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--row-store")
+
+    assert rc == 0
+    assert [(["a"], [[1], [4]]),
+            (["c", "b", "a"], [[6, 5, 4]]),
+            (["a", "b", "c", "a"], [[1, 2, 3, 1], [4, 5, 6, 4]])
+            ] == extract_results(read_out(tmpdir))
+
+
+def test_batch(tmpdir, plantydb):
+    cols = ["a", "b", "c"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1, 3], [1, 2, 4], [2, 1, 5], [2, 1, 6]], 2))
+    write_queries(tmpdir, [
+        "batch",
+        "select c where a=2, b=1",
+        "select c where a=1, b=2",
+        "select x",
+        "select c where a=0, b=1",
+        "select c where a=1",
+        "select c where a=2, b=1, c=6",
+        "end",
+        "select a where a=1, b=1",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb)
+
+    assert rc == 0
+    assert ["query number: 1", "c", "5", "6",
+            "query number: 2", "c", "4",
+            "query error: unknown column name: x",
+            "query number: 3", "c",
+            "query number: 4", "c", "3", "4",
+            "query number: 5", "c", "6",
+            "query number: 6", "a", "1"] == [l.rstrip() for l in read_out(tmpdir)]
+
+
+def test_batch_shared_scan(tmpdir, plantydb):
+    cols = ["a", "b"]
+    values = [[i % 7, i % 5] for i in range(10000)]
+    queries = ["select a, b where a=3, b=[1..2]", "select b where b=4, a=(..1]", "select a where a=6"]
+    write_csv(tmpdir, make_csv(cols, values, 0))
+    write_queries(tmpdir, ["batch"] + queries + ["end"])
+
+    rc = call_planty_db(tmpdir, plantydb)
+
+    assert rc == 0
+    assert [(["a", "b"], [[a, b] for a, b in values if a == 3 and 1 <= b <= 2]),
+            (["b"], [[b] for a, b in values if b == 4 and a <= 1]),
+            (["a"], [[a] for a, b in values if a == 6])
+            ] == extract_results(read_out(tmpdir))
+
+
+def test_query_cache(tmpdir, plantydb):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 2], [3, 4]], 1))
+    write_queries(tmpdir, [
+        "select b where a=3",
+        "select b where a=1",
+        "select  b  where  a=[3..3]",
+        "batch",
+        "select b where a=1",
+        "select a where a=1",
+        "end",
+        "cache",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--cache-size=100000")
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(["b"], [[4]]), (["b"], [[2]]), (["b"], [[4]]), (["b"], [[2]]), (["a"], [[1]])] == \
+        extract_results(lines[:-1])
+    assert lines[-1].startswith("cache: hits=2 misses=3 evictions=0 entries=3 ")
+
+
+def test_explain_analyze(tmpdir, plantydb):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 2], [3, 4], [3, 5], [4, 4]], 1))
+    write_queries(tmpdir, ["explain analyze select b where a=3, b=4", "select a where a=4"])
+
+    rc = call_planty_db(tmpdir, plantydb)
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert "explain: fullscan requests: (first_remaining_column=1, rows=<1..2>)" == lines[0]
+    stages = [re.match(r"explain: stage (\w+) time_ns=\d+ rows_in=(\d+) rows_out=(\d+) binary_searches=(\d+)$", l)
+              for l in lines[1:5]]
+    assert [("parse", "0", "0", "0"),
+            ("range_scan", "4", "2", "2"),
+            ("full_scan", "2", "1", "0"),
+            ("write", "1", "1", "0")] == [s.groups() for s in stages]
+    assert "explain: output bytes: 4" == lines[5]
+    assert [(["a"], [[4]])] == extract_results(lines[6:])
+
+
+def test_explain_analyze_aggregates(tmpdir, plantydb):
+    rows = [[a, a % 7 - 3] for a in range(1000)]
+    write_csv(tmpdir, make_csv(["a", "c"], rows, 1))
+    write_queries(tmpdir, [
+        "explain analyze select count(*), sum(c)",
+        "explain analyze select count(*), sum(c), min(c) where a=[100..199]",
+        "explain analyze select count(*) where c=0",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--range-aggregates=c")
+
+    zeros = str(len([r for r in rows if r[1] == 0]))
+    assert rc == 0
+    stages = [re.match(r"explain: stage (\w+) time_ns=\d+ rows_in=(\d+) rows_out=(\d+) ", l)
+              for l in read_out(tmpdir) if l.startswith("explain: stage")]
+    # prefix sums answer the aggregates, the rows of c are read only when it's restricted
+    assert [("full_scan", "0", "1000"), ("write", "1000", "1"),
+            ("full_scan", "0", "100"), ("write", "100", "1"),
+            ("full_scan", "1000", zeros), ("write", zeros, "1")] == \
+        [s.groups() for s in stages if s.group(1) in ("full_scan", "write")]
+
+
+def test_explain_analyze_group_by(tmpdir, plantydb):
+    rows = [[a, b, a + b] for a in range(50) for b in range(20)]
+    write_csv(tmpdir, make_csv(["a", "b", "c"], rows, 2))
+    write_queries(tmpdir, [
+        "explain analyze select a, count(*), sum(c) group by a",
+        "explain analyze select a, max(c) where a=[10..19] group by a",
+        "insert 3 100 0",
+        "explain analyze select a, count(*), sum(c) group by a",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--range-aggregates=c")
+
+    assert rc == 0
+    stages = [re.match(r"explain: stage (\w+) time_ns=\d+ rows_in=(\d+) rows_out=(\d+) ", l)
+              for l in read_out(tmpdir) if l.startswith("explain: stage")]
+    # groups are found in the key columns, no row is visited by the full scan, also with a delta
+    assert [("full_scan", "0", "1000"), ("write", "1000", "50"),
+            ("full_scan", "0", "200"), ("write", "200", "10"),
+            ("full_scan", "0", "1001"), ("write", "1001", "50")] == \
+        [s.groups() for s in stages if s.group(1) in ("full_scan", "write")]
+
+
+def test_stats(tmpdir, plantydb):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 2], [3, 4], [3, 5]], 1))
+    write_queries(tmpdir, ["select b where a=3", "select b where a=1", "select b where b=4", "select x", "stats"])
+
+    rc = call_planty_db(tmpdir, plantydb)
+
+    assert rc == 0
+    stats = [l.rstrip() for l in read_out(tmpdir) if l.startswith("stats:")]
+    # only "b=4" reads rows, the other queries are answered by the range scan
+    assert re.match(r"stats: uptime_s=\S+ queries=3 errors=1 queries_per_s=\S+ rows_scanned=3 rows_returned=4 "
+                    r"bytes_written=\d+ allocations=\d+$", stats[0])
+    assert ["parse", "range_scan", "full_scan", "write"] == [l.split(" ")[2] for l in stats[1:5]]
+    assert ['shape="0=; select 1" count=2', 'shape="1=; select 1" count=1'] == \
+        [re.match(r"stats: latency (shape=\".*\" count=\d+) ", l).group(1) for l in stats[5:7]]
+
+
+@pytest.mark.parametrize("key_len", [0, 1])
+def test_insert(tmpdir, plantydb, key_len):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1], [3, 3]], key_len))
+    (tmpdir / "more").write(make_csv(cols, [[0, 5], [3, 6]], key_len))
+    write_queries(tmpdir, [
+        "insert 2 4",
+        "insert 1",
+        "select a, b",
+        "append %s" % (tmpdir / "more"),
+        "select a, b where a=[1..3]",
+        "merge",
+        "select b where a=3",
+        "stats",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--cache-size=100000")
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert ["inserted rows: 1", "insert error: row has 1 values instead of 2"] == lines[:2]
+    assert "inserted rows: 2" in lines
+    if key_len:
+        expected = [[[1, 1], [2, 4], [3, 3]], [[1, 1], [2, 4], [3, 3], [3, 6]], [[3], [6]]]
+    else:
+        expected = [[[1, 1], [3, 3], [2, 4]], [[1, 1], [3, 3], [2, 4], [3, 6]], [[3], [6]]]
+    assert [(cols, expected[0]), (cols, expected[1]), (["b"], expected[2])] == \
+        extract_results(l for l in lines[2:] if not l.startswith("insert") and not l.startswith("stats"))
+    assert "stats: table version=3 main_rows=5 delta_segments=0 delta_rows=0" in lines
+
+
+def test_insert_without_arguments(tmpdir, plantydb):
+    write_csv(tmpdir, make_csv(["a"], [1, 3], 1))
+    write_queries(tmpdir, ["insert", "insert ", "append", "inserted 2", "select a"])
+
+    rc = call_planty_db(tmpdir, plantydb)
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert ["insert error: insert needs values", "insert error: insert needs values",
+            "insert error: append needs a file name", "query error: no select at the beginning"] == lines[:4]
+    assert [(["a"], [[1], [3]])] == extract_results(lines[4:])
+
+
+def test_reload(tmpdir, plantydb):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1], [3, 3]], 1))
+    write_queries(tmpdir, [
+        "insert 2 4",
+        "select b",
+        "reload wait",
+        "reload",
+        "reload wait",
+        "select b",
+        "stats",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--cache-size=100000")
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert ["inserted rows: 1", "reload: nothing to wait for", "reload: started", "reload: done, table version 2"] \
+        == [l for l in lines if l.startswith("insert") or l.startswith("reload")]
+    assert [(["b"], [[1], [4], [3]]), (["b"], [[1], [3]])] == \
+        extract_results(l for l in lines if not l.startswith(("insert", "reload", "stats")))
+    assert "stats: reloads done=1 failed=0" in lines
+
+
+def test_column_dir(tmpdir, plantydb):
+    cols = ["a", "b", "c"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1, 5], [2, 1, 6], [2, 2, 7], [4, 1, 8]], 2))
+    write_queries(tmpdir, [
+        "select c where a=2",
+        "select * where c=[6..7]",
+        "insert 3 0 9",
+        "merge",
+        "select a, c where a=[2..3]",
+        "stats",
+    ])
+    column_dir = tmpdir / "columns"
+    column_dir.mkdir()
+
+    for _ in range(2):
+        rc = call_planty_db(tmpdir, plantydb, "--column-dir=%s" % column_dir)
+
+        assert rc == 0
+        assert ["csv.0.bin", "csv.1.bin", "csv.2.bin"] == sorted(p.basename for p in column_dir.listdir())
+        lines = [l.rstrip() for l in read_out(tmpdir)]
+        assert [(["c"], [[6], [7]]), (cols, [[2, 1, 6], [2, 2, 7]]), (["a", "c"], [[2, 6], [2, 7], [3, 9]])] == \
+            extract_results(l for l in lines if not l.startswith(("insert", "stats")))
+        # merged columns don't outlive the process, and the files of the csv keep its rows
+        assert "stats: table version=2 main_rows=5 delta_segments=0 delta_rows=0" in lines
+
+
+def test_column_dir_merge_error(tmpdir, plantydb):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1], [3, 3]], 1))
+    column_dir = tmpdir / "columns"
+    column_dir.mkdir()
+
+    with subprocess.Popen([str(plantydb), "--column-dir=%s" % column_dir, str(tmpdir / "csv")],
+                          stdin=subprocess.PIPE, stdout=subprocess.PIPE, universal_newlines=True) as p:
+        # removed once the table is mapped, new column files can't be written
+        time.sleep(1)
+        column_dir.remove()
+        out, _ = p.communicate("insert 2 2\nmerge\nselect b\nstats\n")
+
+    assert p.returncode == 0
+    lines = [l.rstrip() for l in out.splitlines()]
+    assert ["table error: couldn't create column file in %s" % column_dir] == [l for l in lines if "error:" in l]
+    # queries keep using the main table and the delta
+    assert [(["b"], [[1], [2], [3]])] == \
+        extract_results(l for l in lines if not l.startswith(("insert", "table", "stats")))
+    assert "stats: table version=1 main_rows=2 delta_segments=1 delta_rows=1" in lines
+    assert "stats: merges done=0 failed=1" in lines
+
+
+def test_lazy_columns(tmpdir, plantydb):
+    cols = ["a", "b", "c", "d", "e"]
+    write_csv(tmpdir, make_csv(cols, [[1, 10, 100, 1000, 5], [2, 20, 200, 2000, 6], [3, 30, 300, 3000, 7]], 1))
+    write_queries(tmpdir, [
+        "stats",
+        "select b where a=2",
+        "select c where d=(..2000]",
+        "select e where b=30",
+        "stats",
+        "batch",
+        "select *",
+        "select e where a=1",
+        "end",
+        "stats",
+    ])
+
+    # two lazily loaded columns fit into the budget
+    rc = call_planty_db(tmpdir, plantydb, "--lazy-columns --memory-budget=48")
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(["b"], [[20]]), (["c"], [[100], [200]]), (["e"], [[7]]), (cols, [[1, 10, 100, 1000, 5],
+            [2, 20, 200, 2000, 6], [3, 30, 300, 3000, 7]]), (["e"], [[5]])] == \
+        extract_results(l for l in lines if not l.startswith("stats"))
+    assert ["stats: columns loaded=1/5 loads=0 evictions=0", "stats: columns loaded=3/5 loads=5 evictions=3",
+            "stats: columns loaded=5/5 loads=7 evictions=3"] == [l for l in lines if l.startswith("stats: columns")]
+
+
+def test_lazy_columns_changed_file(tmpdir, plantydb):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 10], [2, 20]], 1))
+
+    with subprocess.Popen([str(plantydb), "--lazy-columns", str(tmpdir / "csv")], stdin=subprocess.PIPE,
+                          stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, universal_newlines=True) as p:
+        # rewritten in place once the key column is loaded, with as many rows
+        time.sleep(1)
+        write_csv(tmpdir, make_csv(cols, [[1, 100], [2, 200]], 1))
+        out, _ = p.communicate("select b\nreload wait\nselect b\n")
+
+    assert p.returncode == 0
+    lines = [l.rstrip() for l in out.splitlines()]
+    assert "query error: table file has changed since it was loaded, reloading it" in lines
+    assert "reload: done, table version 1" in lines
+    assert [(["b"], [[100], [200]])] == extract_results(l for l in lines if not l.startswith(("query error", "reload")))
+
+
+def test_lazy_columns_merge(tmpdir, plantydb):
+    cols = ["a", "b", "c"]
+    write_csv(tmpdir, make_csv(cols, [[1, 10, 100], [3, 30, 300]], 1))
+    write_queries(tmpdir, [
+        "insert 2 20 200",
+        "insert 4 40 400",
+        "merge",
+        "select b",
+        "insert 2 21 201",
+        "merge",
+        "select c",
+        "select *",
+        "stats",
+    ])
+
+    # one of the lazily loaded columns fits into the budget, the other one is read again
+    rc = call_planty_db(tmpdir, plantydb, "--lazy-columns --memory-budget=40")
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(["b"], [[10], [20], [30], [40]]), (["c"], [[100], [200], [201], [300], [400]]),
+            (cols, [[1, 10, 100], [2, 20, 200], [2, 21, 201], [3, 30, 300], [4, 40, 400]])] == \
+        extract_results(l for l in lines if not l.startswith(("insert", "stats")))
+    assert "stats: table version=4 main_rows=5 delta_segments=0 delta_rows=0" in lines
+    assert "stats: columns loaded=3/3 loads=3 evictions=1" in lines
+
+
+@pytest.mark.parametrize("options", ["--huge-pages=transparent", "--huge-pages=hugetlb", "--numa=interleave",
+                                     "--huge-pages=hugetlb --numa=interleave", "--partitions=2 --numa=partitions"])
+def test_memory_policy(tmpdir, plantydb, options):
+    # columns over 2 MB are allocated by the policy
+    rows = [[i, i % 7] for i in range(300000)]
+    write_csv(tmpdir, make_csv(["a", "b"], rows, 1))
+    write_queries(tmpdir, ["select a where a=[1000..1020], b=3", "select b where a=299999"])
+
+    rc = call_planty_db(tmpdir, plantydb, options)
+
+    assert rc == 0
+    assert [(["a"], [[r[0]] for r in rows[1000:1021] if r[1] == 3]), (["b"], [[299999 % 7]])] == \
+        extract_results(read_out(tmpdir))
+
+
+def test_binary_output(tmpdir, plantydb):
+    cols = ["a", "b", "c"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1, 5], [2, 1, -6], [2, 2, 7], [4, 1, 8]], 2))
+    (tmpdir / "other.csv").write(make_csv(["a", "d"], [[2, 10], [4, 11]], 1))
+    write_queries(tmpdir, [
+        "select c, a where a=2",
+        "select b where c=(..7]",
+        "select a where a=3",
+        "select c, a where a=2",
+        "select x",
+        "select c, d from csv join other on a",
+        "insert 3 0 9",
+        "select a, c where a=[2..3]",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--output=binary --cache-size=100000", tables=[tmpdir / "other.csv"])
+
+    assert rc == 0
+    assert ["query number: 1", (["c", "a"], [[-6, 2], [7, 2]]),
+            "query number: 2", (["b"], [[1], [1], [2]]),
+            "query number: 3", (["a"], []),
+            "query number: 4", (["c", "a"], [[-6, 2], [7, 2]]),
+            "query error: unknown column name: x",
+            "query number: 5", (["c", "d"], [[-6, 10], [7, 10], [8, 11]]),
+            "inserted rows: 1",
+            "query number: 6", (["a", "c"], [[2, -6], [2, 7], [3, 9]])] == read_binary_out(tmpdir)
+
+
+@pytest.mark.parametrize("options", ["", "--cache-size=100000", "--output=binary"])
+def test_pipelined_output(tmpdir, plantydb, options):
+    rows = [[i // 3, i % 3, i] for i in range(3000)]
+    write_csv(tmpdir, make_csv(["a", "b", "c"], rows, 2))
+    (tmpdir / "other.csv").write(make_csv(["a", "d"], [[1, 10], [7, 11]], 1))
+    write_queries(tmpdir, [
+        "select *",
+        "select c where a=[10..20], b=1",
+        "select x",
+        "batch",
+        "select a where a=3",
+        "select b where c=(..5]",
+        "end",
+        "select c, d from csv join other on a",
+        "insert 5 9 9",
+        "select * where a=5",
+        "select c where a=[10..20], b=1",
+        "stats",
+    ])
+    outputs = []
+    for pipelined in ["", "--pipelined-output"]:
+        rc = call_planty_db(tmpdir, plantydb, options + " " + pipelined, tables=[tmpdir / "other.csv"])
+
+        assert rc == 0
+        out = (tmpdir / "out").read_binary()
+        stats = out[out.index(b"stats:"):]
+        bytes_written = re.search(rb"bytes_written=(\d+)", stats).group(1)
+        outputs.append((out[:out.index(b"stats:")], bytes_written))
+    assert outputs[0] == outputs[1]
+
+
+@pytest.mark.parametrize("options", ["", "--lazy-columns"])
+def test_group_by(tmpdir, plantydb, options):
+    rows = sorted([a, b, (a * 7 + b * 3 + i) % 11 - 5] for a in range(5) for b in range(a * 3) for i in range(b % 4 + 1))
+    write_csv(tmpdir, make_csv(["a", "b", "c"], rows, 2))
+    write_queries(tmpdir, [
+        "select a, count(*), sum(c), min(b), max(b), min(c) group by a",
+        "select distinct a, b where c=[0..)",
+        "select b, a, max(c) where a=[2..3], b=(1..) group by a, b",
+        "insert 2 0 100",
+        "insert 4 20 -100",
+        "select a, count(*), sum(c), min(b), max(c) group by a",
+        "select distinct a",
+        "select b, count(*) group by b",
+        "select a, c group by a",
+        "select a, count(c) group by a",
+        "select distinct a, count(*)",
+        "select a from csv join csv on a group by a",
+        "batch",
+        "select distinct a",
+        "end",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, options)
+
+    def groups(rows, key_len):
+        res = {}
+        for r in rows:
+            res.setdefault(tuple(r[:key_len]), []).append(r)
+        return sorted(res.items())
+    inserted = sorted(rows + [[2, 0, 100], [4, 20, -100]])
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(["a", "count(*)", "sum(c)", "min(b)", "max(b)", "min(c)"],
+             [[k[0], len(g), sum(r[2] for r in g), min(r[1] for r in g), max(r[1] for r in g), min(r[2] for r in g)]
+              for k, g in groups(rows, 1)]),
+            (["a", "b"], [list(k) for k, g in groups([r for r in rows if r[2] >= 0], 2)]),
+            (["b", "a", "max(c)"], [[k[1], k[0], max(r[2] for r in g)]
+                                    for k, g in groups([r for r in rows if 2 <= r[0] <= 3 and r[1] > 1], 2)]),
+            (["a", "count(*)", "sum(c)", "min(b)", "max(c)"],
+             [[k[0], len(g), sum(r[2] for r in g), min(r[1] for r in g), max(r[2] for r in g)]
+              for k, g in groups(inserted, 1)]),
+            (["a"], [list(k) for k, g in groups(inserted, 1)])] == extract_results(
+                l for l in lines if "error" not in l and "inserted" not in l)
+    assert ["query error: group by columns have to be leading key columns: b",
+            "query error: column has to be grouped or aggregated: c",
+            "query error: only count(*) is supported: count(c)",
+            "query error: distinct can't have aggregates: count(*)",
+            "query error: group by and distinct aren't supported in joins",
+            "query error: group by and distinct are only supported in single queries"] == [
+                l for l in lines if "error" in l]
+
+
+@pytest.mark.parametrize("options", ["", "--range-aggregates=c,b"])
+def test_range_aggregates(tmpdir, plantydb, options):
+    big = 2 ** 62
+    rows = sorted([a, b, (a * 131 + b * 17) % 1000 - 500] for a in range(4) for b in range(a * 150))
+    rows += [[4, 0, big], [4, 1, big], [4, 2, -1]]
+    write_csv(tmpdir, make_csv(["a", "b", "c"], rows, 2))
+    write_queries(tmpdir, [
+        "select count(*), sum(c), min(c), max(c)",
+        "select sum(c), min(c), max(c), max(b) where a=[1..3], b=[5..140)",
+        "select a, sum(c), min(c), max(c) where b=(10..) group by a",
+        "select sum(c), min(c) where c=(400..)",
+        "select count(*), sum(c) where a=9",
+        "select a, sum(c)",
+        # main table groups are still aggregated by ranges, with delta rows added between them
+        "insert 2 500 7",
+        "insert -1 0 3",
+        "insert 2 -1 -600",
+        "select a, count(*), sum(c), min(c), max(c) group by a",
+        "select count(*), sum(c), min(c), max(c) where a=[1..3], b=[5..140)",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, options)
+
+    def wrap(v):
+        return (v + 2 ** 63) % 2 ** 64 - 2 ** 63
+
+    def aggregates(rows):
+        return [wrap(sum(r[2] for r in rows)), min(r[2] for r in rows), max(r[2] for r in rows)]
+    ranged = [r for r in rows if 1 <= r[0] <= 3 and 5 <= r[1] < 140]
+    inserted = sorted(rows + [[2, 500, 7], [-1, 0, 3], [2, -1, -600]])
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(["count(*)", "sum(c)", "min(c)", "max(c)"], [[len(rows)] + aggregates(rows)]),
+            (["sum(c)", "min(c)", "max(c)", "max(b)"], [aggregates(ranged) + [max(r[1] for r in ranged)]]),
+            (["a", "sum(c)", "min(c)", "max(c)"],
+             [[a] + aggregates([r for r in rows if r[0] == a and r[1] > 10]) for a in range(1, 4)]),
+            (["sum(c)", "min(c)"], [aggregates([r for r in rows if r[2] > 400])[:2]]),
+            (["count(*)", "sum(c)"], []),
+            (["a", "count(*)", "sum(c)", "min(c)", "max(c)"],
+             [[a, len([r for r in inserted if r[0] == a])] + aggregates([r for r in inserted if r[0] == a])
+              for a in sorted({r[0] for r in inserted})]),
+            (["count(*)", "sum(c)", "min(c)", "max(c)"], [[len(ranged)] + aggregates(ranged)])] == \
+        extract_results(l for l in lines if "error" not in l and "inserted" not in l)
+    assert ["query error: column has to be grouped or aggregated: a"] == [l for l in lines if "error" in l]
+
+
+@pytest.mark.parametrize("options", ["", "--key-filter", "--key-filter --lazy-columns"])
+def test_key_filter(tmpdir, plantydb, options):
+    rows = [[a, b, a * 100 + b] for a in range(20) for b in range(0, 40, 2)]
+    write_csv(tmpdir, make_csv(["a", "b", "c"], rows, 2))
+    lookups = [(a, b) for a in range(-1, 22, 3) for b in range(-1, 42, 5)]
+    write_queries(tmpdir, ["select c where a=%d, b=%d" % k for k in lookups] + ["batch"]
+                  + ["select c where a=%d, b=%d" % k for k in lookups] + [
+        "end",
+        "insert 3 5 77",
+        "select c where a=3, b=5",
+        "merge",
+        "select c where a=3, b=5",
+        "explain analyze select c where a=3, b=7",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, options)
+
+    expected = [(["c"], [[a * 100 + b]] if 0 <= a < 20 and 0 <= b < 40 and b % 2 == 0 else []) for a, b in lookups]
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert expected * 2 + [(["c"], [[77]])] * 2 == extract_results(
+        l for l in lines if not l.startswith("inserted") and not l.startswith("explain"))
+    range_scan = [l for l in lines if l.startswith("explain: stage range_scan")]
+    assert 1 == len(range_scan)
+    assert range_scan[0].endswith(" filtered_lookups=1") == ("--key-filter" in options)
+
+
+@pytest.mark.parametrize("restricted", [1, 16, 17])
+def test_full_scan_columns(tmpdir, plantydb, restricted):
+    big = 2 ** 63 - 1
+    cols = ["c%d" % i for i in range(18)]
+    rows = [[(r * 7 + c * 3) % 5 for c in range(17)] + [v] for r, v in enumerate([-big - 1, -5, 0, 5, big] * 4)]
+    write_csv(tmpdir, make_csv(cols, rows, 0))
+    preds = ["c%d=[0..3]" % c for c in range(restricted - 1)]
+    write_queries(tmpdir, ["select * where " + ", ".join(preds + [last]) for last in
+                           ["c17=(-5..%d)" % big, "c17=(..0]", "c17=(%d..)" % (-big - 1), "c17=(%d..)" % big,
+                            "c17=[%d..%d]" % (big, big)]])
+
+    rc = call_planty_db(tmpdir, plantydb)
+
+    def select(matches):
+        return (cols, [r for r in rows if all(0 <= r[c] <= 3 for c in range(restricted - 1)) and matches(r[17])])
+    assert rc == 0
+    assert [select(lambda v: -5 < v < big), select(lambda v: v <= 0), select(lambda v: v > -big - 1),
+            select(lambda v: False), select(lambda v: v == big)] == extract_results(read_out(tmpdir))
+
+
+def test_join(tmpdir, plantydb):
+    write_csv(tmpdir, make_csv(["a", "b", "c"], [[1, 1, 5], [2, 1, 6], [2, 2, 7], [4, 1, 8]], 2))
+    (tmpdir / "other.csv").write(make_csv(["a", "b", "d"], [[2, 1, 10], [2, 1, 11], [3, 1, 12], [4, 2, 13]], 2))
+    write_queries(tmpdir, [
+        "select d from other where a=[3..4]",
+        "select * from csv join other on a, b",
+        "select a, c, d from csv join other on a where a=(..3], d=(..10]",
+        "select csv.b, other.b from csv join other on a where c=8",
+        "select b from csv join other on a",
+        "select a from csv join other on b",
+        "select a from missing",
+        "batch",
+        "select a from other",
+        "end",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, tables=[tmpdir / "other.csv"])
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(["d"], [[12], [13]]),
+            (["a", "b", "c", "d"], [[2, 1, 6, 10], [2, 1, 6, 11]]),
+            (["a", "c", "d"], [[2, 6, 10], [2, 7, 10]]),
+            (["csv.b", "other.b"], [[1, 2]])] == extract_results(l for l in lines if "error" not in l)
+    assert ["query error: ambiguous column name: b",
+            "query error: join columns have to be leading key columns of both tables: b",
+            "query error: unknown table name: missing",
+            "query error: batch can only query the default table"] == [l for l in lines if "error" in l]
+
+
+@pytest.mark.parametrize("partitions", [1, 2, 5])
+def test_partitions(tmpdir, plantydb, partitions):
+    cols = ["a", "b"]
+    write_csv(tmpdir, make_csv(cols, [[1, 1], [2, 2], [2, 3], [4, 4], [6, 5]], 1))
+    write_queries(tmpdir, [
+        "select *",
+        "select b where a=[2..4]",
+        "select a where b=5",
+        "select a where a=3",
+        "select c",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--partitions=%d" % partitions)
+
+    assert rc == 0
+    lines = [l.rstrip() for l in read_out(tmpdir)]
+    assert [(cols, [[1, 1], [2, 2], [2, 3], [4, 4], [6, 5]]), (["b"], [[2], [3], [4]]), (["a"], [[6]]), (["a"], [])] \
+        == extract_results(l for l in lines if "error" not in l)
+    assert ["query error: unknown column name: c"] == [l for l in lines if "error" in l]
+
+
+def test_partitions_offsets(tmpdir, plantydb):
+    # workers of later partitions start reading the file from offsets found by the coordinator's scan
+    rows = [[i // 2, i * 7 % 1000] for i in range(20000)]
+    write_csv(tmpdir, make_csv(["a", "b"], rows, 1))
+    write_queries(tmpdir, [
+        "select * where a=[2498..2502]",
+        "select * where a=[7497..7500]",
+        "select a where b=3",
+    ])
+
+    rc = call_planty_db(tmpdir, plantydb, "--partitions=4")
+
+    assert rc == 0
+    assert [(["a", "b"], [r for r in rows if 2498 <= r[0] <= 2502]),
+            (["a", "b"], [r for r in rows if 7497 <= r[0] <= 7500]),
+            (["a"], [[r[0]] for r in rows if r[1] == 3])] == extract_results(read_out(tmpdir))
+
+
+def test_partitions_sighup(tmpdir, plantydb):
+    cols = ["a", "b"]
+    rows = [[i, i % 3] for i in range(10)]
+    write_csv(tmpdir, make_csv(cols, rows, 1))
+
+    with subprocess.Popen([str(plantydb), "--partitions=3", str(tmpdir / "csv")], stdin=subprocess.PIPE,
+                          stdout=subprocess.PIPE, universal_newlines=True, start_new_session=True) as p:
+        p.stdin.write("select *\n")
+        p.stdin.flush()
+        # the query number, the header and the rows, once workers are loaded
+        first = [p.stdout.readline().rstrip() for _ in range(len(rows) + 2)]
+        # workers keep their parts of the file instead of reloading all of it
+        os.killpg(p.pid, signal.SIGHUP)
+        time.sleep(0.5)
+        out, _ = p.communicate("select *\n")
+
+    assert p.returncode == 0
+    assert [(cols, rows), (cols, rows)] == extract_results(first + out.splitlines())
+
+
+def test_partitions_worker_exited(tmpdir, plantydb):
+    cols = ["a", "b"]
+    rows = [[i, i % 3] for i in range(10)]
+    write_csv(tmpdir, make_csv(cols, rows, 1))
+
+    with subprocess.Popen([str(plantydb), "--partitions=2", str(tmpdir / "csv")], stdin=subprocess.PIPE,
+                          stdout=subprocess.PIPE, universal_newlines=True) as p:
+        p.stdin.write("select a, count(*) group by a\n")
+        p.stdin.flush()
+        grouped = p.stdout.readline().rstrip()
+        with open("/proc/%d/task/%d/children" % (p.pid, p.pid)) as f:
+            workers = sorted(int(pid) for pid in f.read().split())
+        os.kill(workers[1], signal.SIGKILL)
+        # a zombie until the coordinator exits
+        while True:
+            with open("/proc/%d/stat" % workers[1]) as f:
+                if f.read().split()[2] == "Z":
+                    break
+            time.sleep(0.01)
+        out, _ = p.communicate("select *\nselect * where a=[1..2]\n")
+
+    assert p.returncode == 0
+    assert "query error: group by, distinct and aggregates aren't supported with --partitions" == grouped
+    lines = out.splitlines()
+    assert ["query error: partition worker %d exited" % workers[1]] == [l for l in lines if "error" in l]
+    assert [(cols, rows[1:3])] == extract_results(l for l in lines if "error" not in l)
+
+
+def test_partitions_unsorted(tmpdir, plantydb):
+    write_csv(tmpdir, make_csv(["a", "b"], [[1, 1], [3, 1], [2, 1], [5, 5]], 1))
+    write_queries(tmpdir, [])
+
+    rc = call_planty_db(tmpdir, plantydb, "--partitions=2")
+
+    assert rc == 26
+    assert ["table error: key of row 2 is lesser than previous row"] == [l.rstrip() for l in read_out(tmpdir)]
+
+
 def test_wrong_column(tmpdir, plantydb):
     cols = ["a"]
     write_csv(tmpdir, make_csv(cols, [], 0))
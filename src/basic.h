@@ -37,6 +37,7 @@ auto merge = [](auto const& range1, auto const& range2) {
             std::back_inserter(v));
     return v;
 };
+auto contains = [](auto const& c, auto const& e) { return std::find(c.begin(), c.end(), e) != c.end(); };
 auto sort = [](auto & c, auto &&...ts) { std::sort(c.begin(), c.end(), ts...); };
 auto sorted = [](auto const& c, auto &&...ts) { auto c2 = c; sort(c2, std::forward(ts)...); return c2; };
 auto lex_compare = [](auto const& r1, auto const& r2)
@@ -0,0 +1,173 @@
+#define NO_MAIN
+#include "source.cc"
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+// Benchmarks of separate engine stages on synthetic in-memory tables, without process startup,
+// file loading or stdout in the measurements. Every benchmark is run `warmup` times untimed and
+// then `reps` times; a JSON line with timing percentiles of a single repetition is printed for each.
+namespace bench {
+struct Config {
+    i64 rows = 1 << 20;
+    i64 reps = 20;
+    i64 warmup = 3;
+    string filter;
+};
+// Discards the output, so that Table::write is measured without any I/O.
+class NullStreambuf : public std::streambuf {
+public:
+    NullStreambuf() : buffer_(1 << 12) { setp(buffer_.data(), buffer_.data() + buffer_.size()); }
+protected:
+    int_type overflow(int_type ch) override {
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+        return traits_type::not_eof(ch);
+    }
+private:
+    vector<char> buffer_;
+};
+// c0 and c1 are the key (c0 = row / 64, c1 = row % 64), the other columns are random in [0, 1000).
+Table make_table(i64 rows, i64 columns_count, i64 key_len) {
+    std::mt19937_64 gen(42);
+    vstr names;
+    vector<IntColumn::ptr> columns;
+    for (auto const c : IntRange(0, columns_count)) {
+        names.push_back("c" + str(c));
+        columns.push_back(IntColumn::make());
+        columns.back()->name() = names.back();
+    }
+    for (auto const r : IntRange(0, rows)) {
+        columns[0]->push_back(r / 64);
+        columns[1]->push_back(r % 64);
+        for (auto const c : IntRange(2, columns_count))
+            columns[c]->push_back(static_cast<value_t>(gen() % 1000));
+    }
+    return Table(Metadata(move(names), key_len), move(columns));
+}
+string make_csv(Table const& tbl) {
+    std::ostringstream os;
+    os << fun::join(tbl.metadata().column_names(), ' ', [](auto const& n) { return n; })
+        << "; " << tbl.metadata().key_len() << '\n';
+    for (auto const r : tbl.row_range()) {
+        for (auto const c : tbl.columns())
+            os << (c == 0 ? "" : " ") << tbl.column(c)->at(r);
+        os << '\n';
+    }
+    return os.str();
+}
+i64 sink = 0;
+class Runner {
+public:
+    Runner(Config const& config) : config_(config) {}
+    // `body` is one repetition doing `ops` operations
+    template <class F>
+    void run(string const& name, i64 ops, F const& body) {
+        if (name.find(config_.filter) == string::npos)
+            return;
+        for ([[maybe_unused]] auto const i : IntRange(0, config_.warmup))
+            body();
+        vi64 times;
+        for ([[maybe_unused]] auto const i : IntRange(0, config_.reps)) {
+            auto const start = std::chrono::steady_clock::now();
+            body();
+            auto const finish = std::chrono::steady_clock::now();
+            times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count());
+        }
+        fun::sort(times);
+        auto const percentile = [&times](double p)
+            { return times[std::min(isize(times) - 1, static_cast<i64>(p * isize(times)))]; };
+        auto const mean = std::accumulate(times.begin(), times.end(), i64(0)) / isize(times);
+        println("{\"revision\": \"" BENCH_REVISION "\", \"benchmark\": \"" + name + "\"" +
+            ", \"rows\": " + str(config_.rows) + ", \"ops\": " + str(ops) + ", \"reps\": " + str(config_.reps) +
+            ", \"min_ns\": " + str(times.front()) + ", \"mean_ns\": " + str(mean) +
+            ", \"p50_ns\": " + str(percentile(0.5)) + ", \"p90_ns\": " + str(percentile(0.9)) +
+            ", \"p99_ns\": " + str(percentile(0.99)) + ", \"max_ns\": " + str(times.back()) +
+            ", \"ns_per_op\": " + str(percentile(0.5) / std::max<i64>(ops, 1)) + "}");
+    }
+private:
+    Config const& config_;
+};
+void run_all(Config const& config) {
+    constexpr i64 lookups = 1000;
+    Runner runner(config);
+    auto const tbl = make_table(config.rows, 10, 2);
+    auto const unsorted = make_table(config.rows, 10, 0);
+    std::mt19937_64 gen(7);
+    auto const random_key = [&] { return static_cast<value_t>(gen() % (config.rows / 64 + 1)); };
+
+    vi64 values;
+    std::generate_n(std::back_inserter(values), lookups, random_key);
+    runner.run("equal_range", lookups, [&] {
+        for (auto const v : values)
+            sink += tbl.column(0)->equal_range(tbl.row_range(), v).len();
+    });
+
+    vector<Query> point_queries;
+    for ([[maybe_unused]] auto const i : IntRange(0, lookups))
+        point_queries.push_back(parse(tbl, "select * where c0=" + str(random_key()) + ", c1=" + str(gen() % 64)));
+    runner.run("range_scan_point", lookups, [&] {
+        for (auto const& q : point_queries)
+            sink += isize(q.where_pred.perform_range_scan(tbl.row_range()).fullscan_requests());
+    });
+    auto const range_query = parse(tbl, "select * where c0=[0..10], c0=[100..110], c0=(1000..1010), c1=[5..9]");
+    runner.run("range_scan_intervals", 1, [&] {
+        sink += isize(range_query.where_pred.perform_range_scan(tbl.row_range()).fullscan_requests());
+    });
+
+    auto const scan_query = parse(unsorted, "select c2 where c2=[0..99], c3=(..500), c4=1, c4=(900..)");
+    auto const scan_requests = scan_query.where_pred.perform_range_scan(unsorted.row_range()).fullscan_requests();
+    runner.run("full_scan", unsorted.rows_count(), [&] {
+        sink += isize(scan_query.where_pred.perform_full_scan(scan_requests));
+    });
+
+    auto const ranges_query = parse(unsorted, "select c2 where c2=[0..99], c3=(..500), c4=(100..900]");
+    auto const ranges_requests = ranges_query.where_pred.perform_range_scan(unsorted.row_range()).fullscan_requests();
+    runner.run("full_scan_ranges", unsorted.rows_count(), [&] {
+        sink += isize(ranges_query.where_pred.perform_full_scan(ranges_requests));
+    });
+
+    auto const write_rows = std::min<i64>(config.rows, 1 << 16);
+    vector<RowNumbers> rows = {RowNumbers(RowRange(0, write_rows - 1))};
+    NullStreambuf null_buf;
+    std::ostream null_stream(&null_buf);
+    for (auto const& [name, select] : {std::pair("write_narrow", "select c2"), std::pair("write_wide", "select *")}) {
+        auto const q = parse(tbl, select);
+        runner.run(name, write_rows, [&] {
+            OutputFrame outp(null_stream);
+            tbl.write(q.select_cols, rows, outp);
+        });
+    }
+    auto const q_wide = parse(tbl, "select *");
+    runner.run("write_wide_binary", write_rows, [&] {
+        OutputFrame outp(null_stream, OutputFrame::Format::binary);
+        tbl.write(q_wide.select_cols, rows, outp);
+    });
+
+    auto const csv = make_csv(make_table(write_rows, 10, 2));
+    runner.run("load", write_rows, [&] {
+        std::istringstream is(csv);
+        InputFrame frame(is);
+        sink += Table::read(frame).rows_count();
+    });
+}
+} // namespace bench
+int main(int argc, char** argv) {
+    bench::Config config;
+    auto const option = [](string const& arg, string const& name, i64& value, i64 min_value = 1) {
+        if (arg.rfind(name, 0) != 0)
+            return false;
+        auto const [res, is_ok] = to_i64(arg.substr(name.size()));
+        if (!is_ok || res < min_value)
+            quit("bad value: " + arg);
+        value = res;
+        return true;
+    };
+    for (auto const i : IntRange(1, argc)) {
+        string const arg(argv[i]);
+        if (!option(arg, "--rows=", config.rows) && !option(arg, "--reps=", config.reps)
+                && !option(arg, "--warmup=", config.warmup, 0))
+            config.filter = arg;
+    }
+    bench::run_all(config);
+    log_info("sink:", bench::sink);
+}
@@ -1,5 +1,12 @@
 #pragma once
 #include "defs.h"
+#include "ranges.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 class Measure {
 public:
@@ -17,3 +24,175 @@ private:
     std::string name_;
     std::chrono::time_point<std::chrono::high_resolution_clock> start_;
 };
+// Operations done by the current thread, sampled by StageMeasure.
+struct OpCounters {
+    i64 binary_searches = 0;
+    // point lookups answered by a key filter without searching
+    i64 filtered_lookups = 0;
+};
+inline thread_local OpCounters op_counters;
+
+// Hardware counters of the calling thread, read with perf_event_open (user space only).
+class HwCounters {
+public:
+    static constexpr int count = 4;
+    using values_t = std::array<i64, count>;
+    static constexpr std::array<char const*, count> names =
+        {"cycles", "instructions", "cache_misses", "branch_misses"};
+    HwCounters() {
+#ifdef __linux__
+        constexpr std::array<u64, count> configs = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (auto const i : IntRange(0, count)) {
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            auto const fd = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds_[0], 0);
+            if (fd < 0) {
+                close_();
+                return;
+            }
+            fds_.push_back(static_cast<int>(fd));
+        }
+        ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+    HwCounters(HwCounters const&) = delete;
+    HwCounters& operator=(HwCounters const&) = delete;
+    ~HwCounters() { close_(); }
+    bool available() const noexcept { return !fds_.empty(); }
+    values_t read() const noexcept {
+        values_t res{};
+#ifdef __linux__
+        struct { u64 nr; u64 values[count]; } group{};
+        if (available() && ::read(fds_[0], &group, sizeof(group)) == sizeof(group))
+            for (auto const i : IntRange(0, count))
+                res[i] = static_cast<i64>(group.values[i]);
+#endif
+        return res;
+    }
+private:
+    void close_() noexcept {
+#ifdef __linux__
+        for (auto const fd : fds_)
+            close(fd);
+#endif
+        fds_.clear();
+    }
+    std::vector<int> fds_;
+};
+
+struct StageProfile {
+    StageProfile(std::string name0) : name(std::move(name0)) {}
+    std::string name;
+    i64 nanoseconds = 0;
+    i64 rows_in = 0;
+    i64 rows_out = 0;
+    i64 binary_searches = 0;
+    i64 filtered_lookups = 0;
+    bool has_hw = false;
+    HwCounters::values_t hw{};
+    StageProfile& operator+=(StageProfile const& other) {
+        nanoseconds += other.nanoseconds;
+        rows_in += other.rows_in;
+        rows_out += other.rows_out;
+        binary_searches += other.binary_searches;
+        filtered_lookups += other.filtered_lookups;
+        has_hw |= other.has_hw;
+        for (auto const i : IntRange(0, HwCounters::count))
+            hw[i] += other.hw[i];
+        return *this;
+    }
+    std::string _str() const {
+        auto s = name + " time_ns=" + str(nanoseconds) + " rows_in=" + str(rows_in) + " rows_out=" + str(rows_out)
+            + " binary_searches=" + str(binary_searches);
+        if (filtered_lookups > 0)
+            s += " filtered_lookups=" + str(filtered_lookups);
+        if (has_hw)
+            for (auto const i : IntRange(0, HwCounters::count))
+                s += std::string(" ") + HwCounters::names[i] + "=" + str(hw[i]);
+        return s;
+    }
+};
+// Adds time and operations done during its lifetime to the profile; rows are filled in by the caller.
+class StageMeasure {
+public:
+    StageMeasure(StageProfile& profile, HwCounters const* hw = nullptr) : profile_(profile), hw_(hw),
+            start_(std::chrono::high_resolution_clock::now()), binary_searches_(op_counters.binary_searches),
+            filtered_lookups_(op_counters.filtered_lookups) {
+        if (hw_)
+            hw_start_ = hw_->read();
+    }
+    ~StageMeasure() {
+        if (hw_) {
+            auto const hw_finish = hw_->read();
+            profile_.has_hw = true;
+            for (auto const i : IntRange(0, HwCounters::count))
+                profile_.hw[i] += hw_finish[i] - hw_start_[i];
+        }
+        auto const finish = std::chrono::high_resolution_clock::now();
+        profile_.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start_).count();
+        profile_.binary_searches += op_counters.binary_searches - binary_searches_;
+        profile_.filtered_lookups += op_counters.filtered_lookups - filtered_lookups_;
+    }
+private:
+    StageProfile& profile_;
+    HwCounters const* hw_;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_;
+    i64 binary_searches_;
+    i64 filtered_lookups_;
+    HwCounters::values_t hw_start_{};
+};
+
+// HDR-style histogram: buckets are exact below 2^sub_bucket_bits, then each power of two is split
+// into 2^sub_bucket_bits buckets, which keeps relative error of reported values under ~6%.
+class LatencyHistogram {
+public:
+    static constexpr int sub_bucket_bits = 4;
+    static constexpr i64 sub_buckets = 1 << sub_bucket_bits;
+    LatencyHistogram() : counts_((64 - sub_bucket_bits) * sub_buckets) {}
+    void record(i64 value) noexcept {
+        value = std::max<i64>(value, 0);
+        ++counts_[bucket_(value)];
+        ++count_;
+        sum_ += value;
+        min_ = count_ == 1 ? value : std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+    i64 count() const noexcept { return count_; }
+    // highest value of the bucket that holds the given fraction of recorded values
+    i64 percentile(double fraction) const noexcept {
+        auto const rank = std::max<i64>(1, static_cast<i64>(std::ceil(fraction * count_)));
+        i64 seen = 0;
+        for (auto const b : IntRange(0, isize(counts_)))
+            if ((seen += counts_[b]) >= rank)
+                return std::min(bucket_max_(b), max_);
+        return max_;
+    }
+    std::string _str() const {
+        return "count=" + str(count_) + " min_ns=" + str(min_) + " mean_ns=" + str(count_ ? sum_ / count_ : 0)
+            + " p50_ns=" + str(percentile(0.5)) + " p90_ns=" + str(percentile(0.9))
+            + " p99_ns=" + str(percentile(0.99)) + " max_ns=" + str(max_);
+    }
+private:
+    static i64 bucket_(i64 value) noexcept {
+        if (value < sub_buckets)
+            return value;
+        auto const shift = 63 - __builtin_clzll(static_cast<u64>(value)) - sub_bucket_bits;
+        return (shift + 1) * sub_buckets + (value >> shift) - sub_buckets;
+    }
+    static i64 bucket_max_(i64 bucket) noexcept {
+        if (bucket < sub_buckets)
+            return bucket;
+        auto const shift = bucket / sub_buckets - 1;
+        return ((bucket % sub_buckets + sub_buckets + 1) << shift) - 1;
+    }
+    std::vector<i64> counts_;
+    i64 count_ = 0, sum_ = 0, min_ = 0, max_ = 0;
+};
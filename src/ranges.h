@@ -1,3 +1,4 @@
+#pragma once
 #include "basic.h"
 
 template <typename IntType = i64>
@@ -4,6 +4,15 @@
 #include "defs.h"
 #include "measure.h"
 #include "ranges.h"
+#include <ext/stdio_filebuf.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace std::string_literals;
 
@@ -115,6 +124,19 @@ public:
     bool is_single_value() const noexcept {
         return !l_infinity_ && !r_infinity_ && !l_open_ && !r_open_ && l_ == r_;
     }
+    // whether the interval has common values with [lo, hi]
+    bool overlaps(value_t lo, value_t hi) const noexcept {
+        bool const reaches_lo = r_infinity_ || (r_open_ ? (r_ > lo) : (r_ >= lo));
+        bool const reaches_hi = l_infinity_ || (l_open_ ? (l_ < hi) : (l_ <= hi));
+        return !empty() && reaches_lo && reaches_hi;
+    }
+    // [lo, hi] with the same values, lo > hi if empty
+    std::pair<value_t, value_t> closed() const noexcept {
+        constexpr auto min = std::numeric_limits<value_t>::min(), max = std::numeric_limits<value_t>::max();
+        if (empty() || (l_open_ && !l_infinity_ && l_ == max) || (r_open_ && !r_infinity_ && r_ == min))
+            return {1, 0};
+        return {l_infinity_ ? min : l_open_ ? l_ + 1 : l_, r_infinity_ ? max : r_open_ ? r_ - 1 : r_};
+    }
     bool contains(value_t const& v) const noexcept {
         bool const l_contains = l_infinity_ || (l_open_ ? (l_ < v) : (l_ <= v));
         bool const r_contains = r_infinity_ || (r_open_ ? (r_ > v) : (r_ >= v));
@@ -167,21 +189,223 @@ private:
     value_t l_, r_;
     bool l_open_, r_open_, l_infinity_, r_infinity_;
 }; // }}}
+// column memory {{{
+// Placement of column storage, set from the command line before any table is read.
+struct MemoryPolicy {
+    enum class HugePages { off, transparent, hugetlb };
+    enum class Numa { off, interleave, partitions };
+    HugePages huge_pages = HugePages::off;
+    // interleave: pages of every column are spread over all nodes, partitions: partition workers are
+    // bound to nodes round-robin, with their memory allocated locally
+    Numa numa = Numa::off;
+    // whether large columns are placed by map_column_memory(), instead of coming from the heap
+    bool maps_columns() const noexcept { return huge_pages != HugePages::off || numa == Numa::interleave; }
+};
+MemoryPolicy memory_policy;
+// "0-3,8,10-11" as in sysfs
+indices_t parse_id_list(string const& s) {
+    indices_t res;
+    std::stringstream ss(s);
+    string part;
+    while (std::getline(ss, part, ',')) {
+        auto const dash = part.find('-');
+        auto const [l, l_ok] = to_i64(part.substr(0, dash));
+        auto const [r, r_ok] = dash == string::npos ? std::pair(l, l_ok) : to_i64(part.substr(dash + 1));
+        if (l_ok && r_ok)
+            for (auto const i : IntRange(l, r + 1))
+                res.push_back(i);
+    }
+    return res;
+}
+// online NUMA nodes, empty if the kernel doesn't tell
+indices_t numa_nodes() {
+    std::ifstream ifs("/sys/devices/system/node/online");
+    string line;
+    std::getline(ifs, line);
+    return parse_id_list(line);
+}
+indices_t numa_node_cpus(index_t node) {
+    std::ifstream ifs("/sys/devices/system/node/node" + str(node) + "/cpulist");
+    string line;
+    std::getline(ifs, line);
+    return parse_id_list(line);
+}
+// bitmask of nodes for mbind() and set_mempolicy(), with its length in bits
+std::pair<vector<unsigned long>, unsigned long> node_mask(indices_t const& nodes) {
+    constexpr i64 bits = 8 * sizeof(unsigned long);
+    vector<unsigned long> mask(1);
+    for (auto const n : nodes) {
+        if (n / bits >= isize(mask))
+            mask.resize(n / bits + 1);
+        mask[n / bits] |= 1ul << (n % bits);
+    }
+    // the kernel ignores the last bit
+    return {mask, isize(mask) * bits + 1};
+}
+// Binds the calling process to cpus of the node and prefers its memory for later allocations.
+// Failures are ignored, the process just runs unbound.
+void bind_to_numa_node(index_t node) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto const cpu : numa_node_cpus(node))
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpus);
+    if (CPU_COUNT(&cpus) > 0)
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    auto const [mask, max_node] = node_mask({node});
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), max_node);
+}
+// Large columns are scanned sequentially over and over, so they're mapped on their own, aligned to
+// huge pages, and advised to use them: a scan then misses the TLB once per 2 MB instead of per 4 kB.
+// hugetlb mappings ask for this page size explicitly, the default one of the system can be larger
+constexpr int huge_page_shift = 21;
+constexpr i64 huge_page_size = i64(1) << huge_page_shift;
+// aligned to huge pages, advised to use transparent ones
+void* map_aligned_column_memory(i64 len) {
+    auto const raw = static_cast<char*>(
+            mmap(nullptr, len + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (raw == MAP_FAILED)
+        throw std::bad_alloc();
+    auto const skip = (huge_page_size - reinterpret_cast<uintptr_t>(raw) % huge_page_size) % huge_page_size;
+    if (skip > 0)
+        munmap(raw, skip);
+    munmap(raw + skip + len, huge_page_size - skip);
+    auto const p = raw + skip;
+    if (memory_policy.huge_pages != MemoryPolicy::HugePages::off)
+        madvise(p, len, MADV_HUGEPAGE);
+    return p;
+}
+void* map_column_memory(i64 bytes) {
+    auto const len = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+    void* p = MAP_FAILED;
+    // fails when the reserved pool is exhausted, transparent huge pages are used then
+    if (memory_policy.huge_pages == MemoryPolicy::HugePages::hugetlb)
+        p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (huge_page_shift << MAP_HUGE_SHIFT), -1, 0);
+    if (p == MAP_FAILED)
+        p = map_aligned_column_memory(len);
+    // before the pages are touched
+    if (memory_policy.numa == MemoryPolicy::Numa::interleave) {
+        auto const [mask, max_node] = node_mask(numa_nodes());
+        syscall(SYS_mbind, p, len, MPOL_INTERLEAVE, mask.data(), max_node, 0);
+    }
+    return p;
+}
+void unmap_column_memory(void* p, i64 bytes) noexcept {
+    munmap(p, (bytes + huge_page_size - 1) / huge_page_size * huge_page_size);
+}
+// Allocator of column storage: with a placement policy, large arrays come from map_column_memory(),
+// everything else from the heap.
+template <class T>
+struct ColumnAllocator {
+    using value_type = T;
+    ColumnAllocator() = default;
+    template <class U> ColumnAllocator(ColumnAllocator<U> const&) noexcept {}
+    T* allocate(size_t n) {
+        auto const bytes = i64(n * sizeof(T));
+        if (!mapped_(bytes))
+            return static_cast<T*>(::operator new(bytes));
+        return static_cast<T*>(map_column_memory(bytes));
+    }
+    void deallocate(T* p, size_t n) noexcept {
+        auto const bytes = i64(n * sizeof(T));
+        if (!mapped_(bytes))
+            ::operator delete(p);
+        else
+            unmap_column_memory(p, bytes);
+    }
+    // the policy doesn't change once tables are read, so both calls agree
+    static bool mapped_(i64 bytes) noexcept { return memory_policy.maps_columns() && bytes >= huge_page_size; }
+    template <class U> bool operator==(ColumnAllocator<U> const&) const noexcept { return true; }
+    template <class U> bool operator!=(ColumnAllocator<U> const&) const noexcept { return false; }
+};
+template <class T> using column_vector = vector<T, ColumnAllocator<T>>;
+// }}}
+class MappedFile { // {{{
+public:
+    // Read-only mapping of the whole file. Pages are read on first access and can be dropped by the
+    // kernel under memory pressure, so only the pages touched by queries take memory.
+    MappedFile(string const& path) {
+        auto const fd = open(path.c_str(), O_RDONLY);
+        table_check(fd >= 0, "couldn't open column file " + path);
+        struct stat st;
+        fstat(fd, &st);
+        size_ = st.st_size;
+        if (size_ > 0)
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        table_check(data_ != MAP_FAILED, "couldn't map column file " + path);
+        // binary searches touch scattered pages, readahead would only waste memory
+        if (size_ > 0)
+            madvise(data_, size_, MADV_RANDOM);
+    }
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    ~MappedFile() {
+        if (size_ > 0)
+            munmap(data_, size_);
+    }
+    void const* data() const noexcept { return data_; }
+    i64 size() const noexcept { return size_; }
+    // asks the kernel to read the pages of [offset, offset + len) ahead, before a sequential scan
+    void will_need(i64 offset, i64 len) const noexcept {
+        static i64 const page = sysconf(_SC_PAGESIZE);
+        auto const begin = offset / page * page;
+        madvise(static_cast<char*>(data_) + begin, offset + len - begin, MADV_WILLNEED);
+    }
+private:
+    void* data_ = nullptr;
+    i64 size_ = 0;
+}; // }}}
 class IntColumn { // {{{
 public:
     using ref = std::reference_wrapper<const IntColumn>;
-    using ptr = std::unique_ptr<IntColumn>;
+    // tables share columns, e.g. a lazily loaded table with the one it was loaded from
+    using ptr = std::shared_ptr<IntColumn>;
 
-    static ptr make() { return std::make_unique<IntColumn>(); }
+    static ptr make() { return std::make_shared<IntColumn>(); }
+    // read-only column of raw values from the file
+    static ptr map(string const& path) {
+        auto res = make();
+        res->file_ = std::make_unique<MappedFile>(path);
+        table_check(res->file_->size() % i64(sizeof(value_t)) == 0, "bad size of column file " + path);
+        res->values_ = static_cast<value_t const*>(res->file_->data());
+        res->size_ = res->file_->size() / i64(sizeof(value_t));
+        return res;
+    }
+    IntColumn() = default;
+    IntColumn(IntColumn const&) = delete;
+    IntColumn& operator=(IntColumn const&) = delete;
 
-    void push_back(const value_t elem) { data_.push_back(elem); }
+    void push_back(const value_t elem) {
+        massert2(!mapped());
+        data_.push_back(elem);
+        update_values_();
+    }
+    void append(IntColumn const& other, RowRange const& rows) {
+        massert2(!mapped());
+        if (!rows.empty())
+            data_.insert(data_.end(), other.values_ + rows.l(), other.values_ + rows.r() + 1);
+        update_values_();
+    }
     cname& name() noexcept { return name_; }
     const cname& name() const noexcept { return name_; }
-    const value_t& at(index_t index) const noexcept { bound_assert(index, data_); return data_[index]; }
-    index_t rows_count() const noexcept { return isize(data_); }
+    const value_t& at(index_t index) const noexcept {
+        massert(index >= 0 && index < size_, "Index " + std::to_string(index) + " out of bounds of column " + name_);
+        return values_[index];
+    }
+    index_t rows_count() const noexcept { return size_; }
+    value_t const* data() const noexcept { return values_; }
+    bool mapped() const noexcept { return file_ != nullptr; }
+    // hint before a sequential scan of the rows, for mapped columns
+    void prefetch(RowRange const& rows) const noexcept {
+        if (mapped() && !rows.empty())
+            file_->will_need(rows.l() * i64(sizeof(value_t)), rows.len() * i64(sizeof(value_t)));
+    }
     RowRange equal_range(const RowRange& rng, value_t val) const noexcept {
-        auto const r = std::equal_range(data_.begin() + rng.l(), data_.begin() + rng.r() + 1, val);
-        return RowRange(r.first - data_.begin(), r.second - data_.begin() - 1);
+        ++op_counters.binary_searches;
+        auto const r = std::equal_range(values_ + rng.l(), values_ + rng.r() + 1, val);
+        return RowRange(r.first - values_, r.second - values_ - 1);
     }
     RowRange equal_range(RowRange const& rng, ValueInterval const& val) const noexcept {
         // todo:
@@ -215,15 +439,23 @@ public:
         }
         return RowRange(l, r);
     }
-    string _repr() const { return make_repr("IntColumn", {"name", "length"}, name_, isize(data_)); }
+    string _repr() const { return make_repr("IntColumn", {"name", "length"}, name_, size_); }
 private:
-    vector<value_t> data_;
+    void update_values_() noexcept {
+        values_ = data_.data();
+        size_ = isize(data_);
+    }
+    column_vector<value_t> data_;
+    std::unique_ptr<MappedFile> file_;
+    // either data_ or the mapped file
+    value_t const* values_ = nullptr;
+    index_t size_ = 0;
     cname name_;
 }; // }}}
 class RowNumbers; // {{{
 class RowNumbersEraser {
 public:
-    RowNumbersEraser(RowNumbers & rows) : rows_(rows) { indices_.reserve(65536); }
+    RowNumbersEraser(RowNumbers & rows);
     ~RowNumbersEraser() noexcept;
     // note: opportunity for optimization
     void keep(index_t idx) { massert2(indices_.empty() || indices_.back() < idx); indices_.push_back(idx); }
@@ -254,6 +486,14 @@ public:
             for (auto const row_id : range_)
                 f(row_id);
     }
+    index_t count() const noexcept { return indices_set_used_ ? isize(indices_) : range_.len(); }
+    bool is_range() const noexcept { return !indices_set_used_; }
+    // row number at the position, in order of foreach()
+    index_t at(i64 pos) const noexcept {
+        massert2(pos >= 0 && pos < count());
+        return indices_set_used_ ? indices_[pos] : range_.l() + pos;
+    }
+    i64 size_in_bytes() const noexcept { return sizeof(*this) + isize(indices_) * sizeof(index_t); }
     template <typename F>
     static void foreach(vector<RowNumbers> const& rows, F const& f) {
         for (auto const& r : rows)
@@ -267,6 +507,9 @@ private:
     indices_t indices_ = {};
     bool indices_set_used_ = false;
 };
+RowNumbersEraser::RowNumbersEraser(RowNumbers & rows) : rows_(rows) {
+    indices_.reserve(std::min<index_t>(rows_.as_range().len(), 65536));
+}
 RowNumbersEraser::~RowNumbersEraser() noexcept {
     massert2(!rows_.indices_set_used_);
     if (isize(indices_) == rows_.range_.len())
@@ -285,6 +528,7 @@ public:
     }
     i64 columns_count() const { return isize(columns_); }
     index_t column_id(const cname& name) const { return resolve_column_(name); }
+    bool has_column(const cname& name) const { return fun::contains(columns_, name); }
     indices_t column_ids(const cnames& names) const {
         indices_t res;
         for (auto const& name : names)
@@ -296,6 +540,7 @@ public:
     IntRange columns() const { return IntRange(0, columns_count()); }
     auto const& key_len() const { return key_len_; }
     IntRange key_columns() const { return IntRange(0, key_len()); }
+    bool operator==(Metadata const& other) const { return columns_ == other.columns_ && key_len_ == other.key_len_; }
     string _repr() const { return make_repr("Metadata", {"columns", "key_len"}, columns_, key_len_); }
 private:
     index_t resolve_column_(cname const& name) const {
@@ -311,7 +556,8 @@ private:
 // input, output frame {{{
 class InputFrame {
 public:
-    InputFrame(std::istream& is) : is_(is) {
+    // values are read from the byte offset, if given, instead of right after the header
+    InputFrame(std::istream& is, i64 offset = 0) : is_(is), offset_(offset) {
     }
     // todo: rewrite whole read/write part
     Metadata get_metadata() {
@@ -335,6 +581,8 @@ public:
         }
         if (metadata_found)
             is_ >> key_len;
+        if (offset_ > 0)
+            is_.seekg(offset_);
         ++(*this);
         dprintln("header", header);
         auto m = Metadata(move(header), move(key_len));
@@ -347,41 +595,337 @@ public:
 private:
     value_t val_;
     std::istream& is_;
+    i64 offset_;
 };
+// Binary results are columnar, in host byte order:
+//     "PLTB", u32 columns count, (u32 name length, name) for every column, u64 rows count,
+//     then all values of the first column as i64, all values of the second one...
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "binary output is little-endian");
 class OutputFrame {
 public:
-    OutputFrame(std::ostream& os) : os_(os) {
+    enum class Format { text, binary };
+    OutputFrame(std::ostream& os, Format format = Format::text) : os_(os), format_(format) {
     }
+    OutputFrame(OutputFrame const&) = delete;
+    OutputFrame& operator=(OutputFrame const&) = delete;
+    bool binary() const noexcept { return format_ == Format::binary; }
     void add_header(const vstr& header) {
         table_check(!header.empty(), "header can't be empty");
+        if (binary()) {
+            header_ = header;
+            values_.resize(header.size());
+            return;
+        }
         os_ << header[0];
         for (i64 i = 1; i < isize(header); i++)
             os_ << ' ' << header[i];
     }
-    void new_row(const i64& val) { os_ << '\n' << val; }
+    // in the binary format, rows are gathered and written column by column at the end
+    void new_row(const i64& val) {
+        if (binary()) {
+            values_[column_ = 0].push_back(val);
+            return;
+        }
+        os_ << '\n' << val;
+    }
     void add_to_row(const i64& val) {
+        if (binary()) {
+            values_[++column_].push_back(val);
+            return;
+        }
         os_ << ' ' << val;
     }
+    // Binary format only: values of the rows are written straight from the columns, with contiguous
+    // ranges of rows copied at once.
+    void add_columns(vector<IntColumn const*> const& columns, vector<RowNumbers> const& rows) {
+        massert2(binary() && isize(columns) == isize(header_));
+        i64 rows_count = 0;
+        for (auto const& r : rows)
+            rows_count += r.count();
+        write_header_(rows_count);
+        vector<value_t> buffer;
+        for (auto const col : columns) {
+            for (auto const& r : rows) {
+                if (r.is_range()) {
+                    if (!r.as_range().empty())
+                        write_(col->data() + r.as_range().l(), r.count());
+                    continue;
+                }
+                buffer.clear();
+                r.foreach([&buffer, col](index_t row) { buffer.push_back(col->at(row)); });
+                write_(buffer.data(), isize(buffer));
+            }
+        }
+        written_ = true;
+    }
     ~OutputFrame() {
-        os_ << '\n';
-        // add metadata etc, sure, why not
+        if (!binary()) {
+            os_ << '\n';
+            return;
+        }
+        if (written_)
+            return;
+        write_header_(values_.empty() ? 0 : isize(values_.front()));
+        for (auto const& column : values_)
+            write_(column.data(), isize(column));
     }
 private:
+    void write_header_(i64 rows_count) {
+        os_.write("PLTB", 4);
+        write_u32_(isize(header_));
+        for (auto const& name : header_) {
+            write_u32_(isize(name));
+            os_.write(name.data(), isize(name));
+        }
+        auto const rows = uint64_t(rows_count);
+        os_.write(reinterpret_cast<char const*>(&rows), sizeof(rows));
+    }
+    void write_u32_(i64 value) {
+        auto const v = uint32_t(value);
+        os_.write(reinterpret_cast<char const*>(&v), sizeof(v));
+    }
+    void write_(value_t const* values, i64 count) {
+        os_.write(reinterpret_cast<char const*>(values), count * i64(sizeof(value_t)));
+    }
     std::ostream& os_;
+    Format const format_;
+    // of the binary format
+    vstr header_;
+    vector<vector<value_t>> values_;
+    i64 column_ = 0;
+    bool written_ = false;
+};
+// }}}
+// static dispatch {{{
+// Hot loops over columns are instantiated for small counts known at compile time, so that the loop
+// is unrolled and column pointers stay in registers; larger counts take the generic path.
+constexpr i64 max_static_columns = 16;
+constexpr i64 dynamic_count = -1;
+template <i64 N>
+using count_t = std::integral_constant<i64, N>;
+// f(count_t<n>()) if n is at most Max, f(count_t<dynamic_count>()) otherwise
+template <i64 Max, i64 N = 0, class F>
+void dispatch_count(i64 n, F const& f) {
+    if constexpr (N > Max)
+        f(count_t<dynamic_count>());
+    else if (n == N)
+        f(count_t<N>());
+    else
+        dispatch_count<Max, N + 1>(n, f);
+}
+template <class F, std::size_t... I>
+void static_for_(F const& f, std::index_sequence<I...>) { (f(count_t<i64(I)>()), ...); }
+// f(count_t<0>()), ..., f(count_t<N - 1>())
+template <i64 N, class F>
+void static_for(F const& f) { static_for_(f, std::make_index_sequence<std::max<i64>(N, 0)>()); }
+// }}}
+// row store {{{
+// Row-major copy of the whole table, used when the output projects most of the columns:
+// gathering a row touches one cache line instead of one per column.
+class RowStore {
+public:
+    RowStore(vector<IntColumn::ptr> const& columns) : width_(isize(columns)) {
+        massert2(!columns.empty());
+        auto const rows_count = columns[0]->rows_count();
+        data_.resize(rows_count * width_);
+        for (auto const c : IntRange(0, width_))
+            for (auto const r : IntRange(0, rows_count))
+                data_[r * width_ + c] = columns[c]->at(r);
+    }
+    value_t const* row(index_t index) const noexcept {
+        bound_assert(index * width_, data_);
+        return data_.data() + index * width_;
+    }
+    i64 width() const noexcept { return width_; }
+    string _repr() const { return make_repr("RowStore", {"width", "length"}, width_, isize(data_)); }
+private:
+    i64 width_;
+    column_vector<value_t> data_;
+};
+// }}}
+// range aggregates {{{
+// Sum, min and max of a column over any range of rows with a few memory reads: prefix sums, and a sparse
+// table of min/max over blocks of rows, so only the partial blocks at the ends of a range are scanned.
+class RangeAggregates {
+public:
+    static constexpr i64 block_size = 64;
+    RangeAggregates(IntColumn::ptr column) : col_(move(column)) {
+        auto const& col = *col_;
+        auto const n = col.rows_count();
+        sums_.resize(n + 1);
+        for (auto const r : IntRange(0, n))
+            sums_[r + 1] = sums_[r] + uint64_t(col.at(r));
+        auto const blocks = (n + block_size - 1) / block_size;
+        for (i64 len = 1; len <= blocks; len *= 2) {
+            auto& mins = mins_.emplace_back(blocks - len + 1);
+            auto& maxs = maxs_.emplace_back(blocks - len + 1);
+            for (auto const b : IntRange(0, blocks - len + 1)) {
+                if (len == 1) {
+                    auto const rows = block_rows_(b);
+                    auto const [min, max] = std::minmax_element(col.data() + rows.l(), col.data() + rows.r() + 1);
+                    mins[b] = *min;
+                    maxs[b] = *max;
+                } else {
+                    mins[b] = std::min(mins_[mins_.size() - 2][b], mins_[mins_.size() - 2][b + len / 2]);
+                    maxs[b] = std::max(maxs_[maxs_.size() - 2][b], maxs_[maxs_.size() - 2][b + len / 2]);
+                }
+            }
+        }
+    }
+    // wraps around on overflow
+    value_t sum(RowRange const& rows) const noexcept {
+        massert2(!rows.empty());
+        return value_t(sums_[rows.r() + 1] - sums_[rows.l()]);
+    }
+    value_t min(RowRange const& rows) const noexcept {
+        return fold_(rows, mins_, [](value_t a, value_t b) { return std::min(a, b); });
+    }
+    value_t max(RowRange const& rows) const noexcept {
+        return fold_(rows, maxs_, [](value_t a, value_t b) { return std::max(a, b); });
+    }
+    i64 bytes() const noexcept {
+        i64 res = isize(sums_) * i64(sizeof(uint64_t));
+        for (auto const& level : mins_)
+            res += 2 * isize(level) * i64(sizeof(value_t));
+        return res;
+    }
+    string _repr() const { return make_repr("RangeAggregates", {"rows", "levels"}, isize(sums_) - 1, isize(mins_)); }
+private:
+    RowRange block_rows_(i64 block) const noexcept {
+        return RowRange(block * block_size, std::min((block + 1) * block_size, col_->rows_count()) - 1);
+    }
+    template <class F>
+    value_t fold_(RowRange const& rows, vector<vector<value_t>> const& levels, F f) const noexcept {
+        massert2(!rows.empty());
+        auto const first = (rows.l() + block_size - 1) / block_size;
+        auto const last = (rows.r() + 1) / block_size;
+        if (first >= last) {
+            // no whole block inside
+            auto res = col_->at(rows.l());
+            for (auto const r : IntRange(rows.l() + 1, rows.r() + 1))
+                res = f(res, col_->at(r));
+            return res;
+        }
+        // two overlapping runs of 2^level blocks cover [first, last)
+        auto const level = 63 - __builtin_clzll(uint64_t(last - first));
+        auto res = f(levels[level][first], levels[level][last - (i64(1) << level)]);
+        for (auto const r : IntRange(rows.l(), first * block_size))
+            res = f(res, col_->at(r));
+        for (auto const r : IntRange(last * block_size, rows.r() + 1))
+            res = f(res, col_->at(r));
+        return res;
+    }
+    IntColumn::ptr col_;
+    vector<uint64_t> sums_;
+    // level l has min/max of every run of 2^l blocks
+    vector<vector<value_t>> mins_, maxs_;
+};
+// }}}
+// key filter {{{
+// Blocked Bloom filter over whole keys: a key sets one bit in each word of a single cache line, so a
+// lookup of a missing key is usually rejected after reading one line, without descending the key columns.
+class KeyFilter {
+public:
+    static constexpr i64 bits_per_key = 10;
+    KeyFilter(vector<IntColumn::ptr> const& columns, i64 key_len) : key_len_(key_len) {
+        massert2(key_len > 0);
+        auto const rows_count = columns[0]->rows_count();
+        blocks_.resize(std::max<i64>(1, (rows_count * bits_per_key + block_bits - 1) / block_bits));
+        table_check(isize(blocks_) <= std::numeric_limits<uint32_t>::max(), "too many rows for a key filter");
+        vi64 key(key_len);
+        for (auto const r : IntRange(0, rows_count)) {
+            for (auto const c : IntRange(0, key_len))
+                key[c] = columns[c]->at(r);
+            auto const h = hash_(key);
+            auto& block = block_(h);
+            for (auto const w : IntRange(0, block_words))
+                block.words[w] |= bit_(h, w);
+        }
+    }
+    // false only if no row has the key
+    bool may_contain(vi64 const& key) const noexcept {
+        massert2(isize(key) == key_len_);
+        auto const h = hash_(key);
+        auto const& block = block_(h);
+        uint64_t missing = 0;
+        for (auto const w : IntRange(0, block_words))
+            missing |= ~block.words[w] & bit_(h, w);
+        return missing == 0;
+    }
+    i64 bytes() const noexcept { return isize(blocks_) * i64(sizeof(Block)); }
+    string _repr() const { return make_repr("KeyFilter", {"key_len", "blocks"}, key_len_, isize(blocks_)); }
+private:
+    static constexpr i64 block_words = 8;
+    static constexpr i64 block_bits = block_words * 64;
+    struct alignas(64) Block {
+        uint64_t words[block_words] = {};
+    };
+    static uint64_t mix_(uint64_t x) noexcept {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    static uint64_t hash_(vi64 const& key) noexcept {
+        uint64_t h = 0;
+        for (auto const v : key)
+            h = mix_(h + uint64_t(v) + 0x9e3779b97f4a7c15ULL);
+        return h;
+    }
+    // the high half of the hash picks the block, the low one a bit of each word
+    Block const& block_(uint64_t h) const noexcept {
+        return blocks_[i64((h >> 32) * blocks_.size() >> 32)];
+    }
+    Block& block_(uint64_t h) noexcept { return const_cast<Block&>(std::as_const(*this).block_(h)); }
+    // odd multipliers, one per word, as in split block Bloom filters of Parquet
+    static constexpr std::array<uint32_t, block_words> salts = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+    static uint64_t bit_(uint64_t h, i64 word) noexcept {
+        return uint64_t(1) << ((uint32_t(h) * salts[word]) >> 26);
+    }
+    i64 key_len_;
+    vector<Block> blocks_;
 };
 // }}}
 // table {{{
 class ColumnHandle;
 class Table {
 public:
-    Table(Metadata metadata0, vector<IntColumn::ptr> columns0)
-            : md_(move(metadata0)), columns_(move(columns0)) {
+    // columns which aren't loaded are empty placeholders, see read()
+    Table(Metadata metadata0, vector<IntColumn::ptr> columns0, vector<bool> loaded = {})
+            : md_(move(metadata0)), columns_(move(columns0)),
+              loaded_(loaded.empty() ? vector<bool>(columns_.size(), true) : move(loaded)) {
         massert2(md_.columns_count() == isize(columns_));
+        massert2(isize(loaded_) == isize(columns_));
     }
 public:
-    static Table read(InputFrame& frame);
-    void write(const vector<ColumnHandle>& columns, const vector<RowNumbers>& rows, OutputFrame& frame);
-    void write(const cnames& names, const vector<RowNumbers>& rows, OutputFrame& frame);
+    // Only given rows are kept, the rest of the file is skipped. If columns are given, only they and
+    // the key columns (at least the first column) are loaded, the rest are left for with_columns().
+    static Table read(InputFrame& frame, RowRange rows = RowRange(0, std::numeric_limits<index_t>::max() - 1),
+            std::optional<indices_t> const& columns = std::nullopt);
+    // rows don't have to be sorted
+    static Table from_rows(Metadata md, vector<vi64> rows);
+    // rows of the other table go after rows of this one with equal keys, columns not loaded in either
+    // table are placeholders
+    Table merged(Table const& other) const;
+    // ranges of rows of this table and the other one, in the order of merged()
+    vector<std::pair<Table const*, RowRange>> merge_runs(Table const& other) const;
+    void write(const vector<ColumnHandle>& columns, const vector<RowNumbers>& rows, OutputFrame& frame) const;
+    void write(const cnames& names, const vector<RowNumbers>& rows, OutputFrame& frame) const;
+    void write_row(indices_t const& columns, index_t row, OutputFrame& frame) const {
+        frame.new_row(columns_[columns[0]]->at(row));
+        for (auto const i : IntRange(1, isize(columns)))
+            frame.add_to_row(columns_[columns[i]]->at(row));
+    }
+    bool key_less(index_t row, Table const& other, index_t other_row) const noexcept {
+        return compare_key(row, other, other_row, md_.key_len()) < 0;
+    }
+    // compares first len key columns of the row with the row of the other table: -1, 0 or 1
+    int compare_key(index_t row, Table const& other, index_t other_row, i64 len) const noexcept {
+        for (auto const c : IntRange(0, len))
+            if (columns_[c]->at(row) != other.columns_[c]->at(other_row))
+                return columns_[c]->at(row) < other.columns_[c]->at(other_row) ? -1 : 1;
+        return 0;
+    }
 
     i64 rows_count() const { return columns_[0]->rows_count(); }
     RowRange row_range() const { return RowRange(0, rows_count() - 1); }
@@ -393,15 +937,70 @@ public:
         return columns_[column_id];
     }
     const Metadata& metadata() const noexcept { return md_; }
+    bool loaded(index_t column_id) const { bound_assert(column_id, loaded_); return loaded_[column_id]; }
+    bool loaded(indices_t const& columns) const
+        { return std::all_of(columns.begin(), columns.end(), [this](index_t c) { return loaded(c); }); }
+    // a table sharing the columns, with placeholders replaced by columns loaded in the other table
+    Table with_columns(Table const& other) const {
+        auto columns = columns_;
+        auto loaded = loaded_;
+        for (auto const c : this->columns()) {
+            if (!loaded[c] && other.loaded(c)) {
+                columns[c] = other.columns_[c];
+                loaded[c] = true;
+            }
+        }
+        Table res(md_, move(columns), move(loaded));
+        res.key_filter_ = key_filter_;
+        return res;
+    }
+    // a table sharing the columns, except for the given ones, which are left as placeholders
+    Table without_columns(indices_t const& ids) const {
+        auto columns = columns_;
+        auto loaded = loaded_;
+        for (auto const c : ids) {
+            columns[c] = IntColumn::make();
+            columns[c]->name() = md_.column_name(c);
+            loaded[c] = false;
+        }
+        Table res(md_, move(columns), move(loaded));
+        res.key_filter_ = key_filter_;
+        return res;
+    }
 
     index_t column_id(const cname& name) const { return md_.column_id(name); }
     IntRange key_columns() const { return md_.key_columns(); }
     i64 columns_count() const { return md_.columns_count(); }
     IntRange columns() const { return md_.columns(); }
+    void build_row_store() { row_store_.emplace(columns_); }
+    bool has_row_store() const noexcept { return row_store_.has_value(); }
+    void build_aggregates(indices_t const& ids) {
+        aggregates_.resize(columns_.size());
+        for (auto const c : ids)
+            aggregates_[c] = std::make_shared<const RangeAggregates>(columns_[c]);
+    }
+    // nullptr unless built for the column
+    RangeAggregates const* aggregates(index_t column_id) const noexcept {
+        return column_id < isize(aggregates_) ? aggregates_[column_id].get() : nullptr;
+    }
+    void build_key_filter() {
+        if (md_.key_len() > 0)
+            key_filter_ = std::make_shared<const KeyFilter>(columns_, md_.key_len());
+    }
+    KeyFilter const* key_filter() const noexcept { return key_filter_.get(); }
 private:
+    // row store pays off once the output touches at least half of the columns
+    bool use_row_store_(i64 selected_count) const noexcept
+        { return has_row_store() && 2 * selected_count >= columns_count(); }
     Metadata md_;
     // todo: rethink column metadata
     vector<IntColumn::ptr> columns_;
+    vector<bool> loaded_;
+    std::optional<RowStore> row_store_;
+    // by column id, shared by copies of the table
+    vector<std::shared_ptr<RangeAggregates const>> aggregates_;
+    // kept by tables with other non-key columns loaded, see with_columns()
+    std::shared_ptr<KeyFilter const> key_filter_;
 };
 // }}}
 // column handle {{{
@@ -413,48 +1012,146 @@ public:
         col_id_(column_id), col_(*tbl.column(col_id_)) {}
     const IntColumn& ref() const { return col_; }
     index_t id() const { return col_id_; }
-    string _repr() const { return make_repr("ColumnHandle", {"column"}, col_.get()); }
+    string _repr() const { return "ColumnHandle(column=" + col_.get()._repr() + ")"; }
 private:
     index_t col_id_;
     const IntColumn::ref col_;
 };
 // }}}
 // read/write {{{
-void Table::write(const vector<ColumnHandle>& columns, const vector<RowNumbers>& rows, OutputFrame& frame) {
+void Table::write(const vector<ColumnHandle>& columns, const vector<RowNumbers>& rows, OutputFrame& frame) const {
     // todo un-lazy it
     vstr names;
     for (const auto& col : columns)
         names.push_back(col.ref().name());
     write(names, rows, frame);
 }
-Table Table::read(InputFrame& frame) {
+Table Table::read(InputFrame& frame, RowRange rows, std::optional<indices_t> const& columns_to_read) {
     auto md = frame.get_metadata();
     vector<IntColumn::ptr> columns(md.columns_count());
     for (auto const i : md.columns()) {
         columns[i] = IntColumn::make();
         columns[i]->name() = md.column_name(i);
     }
-    auto column_it = columns.begin();
-    for (auto elem = *frame; !frame.end(); elem = *(++frame)) {
-        (*column_it)->push_back(elem);
-        if (++column_it == columns.end()) column_it = columns.begin();
+    vector<bool> loaded(columns.size(), !columns_to_read);
+    if (columns_to_read) {
+        for (auto const c : IntRange(0, std::max<i64>(md.key_len(), 1)))
+            loaded[c] = true;
+        for (auto const c : *columns_to_read)
+            loaded[c] = true;
+    }
+    i64 column = 0;
+    index_t row = 0;
+    for (auto elem = *frame; !frame.end() && row <= rows.r(); elem = *(++frame)) {
+        if (row >= rows.l() && loaded[column])
+            columns[column]->push_back(elem);
+        if (++column == isize(columns)) {
+            column = 0;
+            ++row;
+        }
     }
-    table_check(column_it == columns.begin(), "couldn't read the same number of values for each column");
-    Table tbl(move(md), move(columns));
+    table_check(column == 0, "couldn't read the same number of values for each column");
+    Table tbl(move(md), move(columns), move(loaded));
     dprintln("rows:", tbl.rows_count(), "columns:", tbl.columns_count());
     return tbl;
 }
-void Table::write(const cnames& names, const vector<RowNumbers>& rows, OutputFrame& frame) {
+Table Table::from_rows(Metadata md, vector<vi64> rows) {
+    for (auto const& row : rows)
+        table_check(isize(row) == md.columns_count(), "row has", isize(row), "values instead of",
+                md.columns_count());
+    auto const key_len = md.key_len();
+    std::stable_sort(rows.begin(), rows.end(), [key_len](vi64 const& a, vi64 const& b) {
+        return std::lexicographical_compare(a.begin(), a.begin() + key_len, b.begin(), b.begin() + key_len);
+    });
+    vector<IntColumn::ptr> columns(md.columns_count());
+    for (auto const i : md.columns()) {
+        columns[i] = IntColumn::make();
+        columns[i]->name() = md.column_name(i);
+        for (auto const& row : rows)
+            columns[i]->push_back(row[i]);
+    }
+    return Table(move(md), move(columns));
+}
+Table Table::merged(Table const& other) const {
+    massert2(md_ == other.md_);
+    vector<IntColumn::ptr> res_columns(columns_count());
+    vector<bool> loaded(columns_count());
+    for (auto const i : columns()) {
+        res_columns[i] = IntColumn::make();
+        res_columns[i]->name() = md_.column_name(i);
+        loaded[i] = loaded_[i] && other.loaded_[i];
+    }
+    for (auto const& [tbl, rows] : merge_runs(other))
+        for (auto const i : tbl->columns())
+            if (loaded[i])
+                res_columns[i]->append(*tbl->column(i), rows);
+    return Table(md_, move(res_columns), move(loaded));
+}
+vector<std::pair<Table const*, RowRange>> Table::merge_runs(Table const& other) const {
+    massert2(md_ == other.md_);
+    vector<std::pair<Table const*, RowRange>> res;
+    auto const append = [&res](Table const& tbl, RowRange const& rows) {
+        if (!rows.empty())
+            res.emplace_back(&tbl, rows);
+    };
+    index_t from = 0;
+    for (auto const r : other.row_range()) {
+        // first row of this table with key greater than r's
+        index_t lo = from, hi = rows_count();
+        while (lo < hi) {
+            auto const mid = lo + (hi - lo) / 2;
+            if (other.key_less(r, *this, mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        append(*this, RowRange(from, lo - 1));
+        append(other, RowRange(r, r));
+        from = lo;
+    }
+    append(*this, RowRange(from, rows_count() - 1));
+    return res;
+}
+void Table::write(const cnames& names, const vector<RowNumbers>& rows, OutputFrame& frame) const {
     frame.add_header(names);
     auto const columns = md_.column_ids(names);
     auto const columns_count = isize(columns);
     massert(columns_count > 0, "can't select 0 columns");
-    RowNumbers::foreach(rows,
-            [&frame, &columns_ = columns_, columns_count, &columns]
-            (i64 row_num) {
-        frame.new_row(columns_[columns[0]]->at(row_num));
-        for (auto const i : IntRange(1, columns_count))
-            frame.add_to_row(columns_[columns[i]]->at(row_num));
+    if (frame.binary()) {
+        auto const cols = fun::map(columns, [this](index_t c) { return static_cast<IntColumn const*>(columns_[c].get()); });
+        frame.add_columns(cols, rows);
+        return;
+    }
+    if (use_row_store_(columns_count)) {
+        RowNumbers::foreach(rows,
+                [&frame, &row_store = *row_store_, columns_count, &columns]
+                (i64 row_num) {
+            auto const row = row_store.row(row_num);
+            frame.new_row(row[columns[0]]);
+            for (auto const i : IntRange(1, columns_count))
+                frame.add_to_row(row[columns[i]]);
+        });
+        return;
+    }
+    dispatch_count<max_static_columns>(columns_count, [&](auto n) {
+        constexpr i64 N = decltype(n)::value;
+        if constexpr (N > 0) {
+            std::array<value_t const*, N> values;
+            for (auto const i : IntRange(0, N))
+                values[i] = columns_[columns[i]]->data();
+            RowNumbers::foreach(rows, [&frame, &values](i64 row_num) {
+                frame.new_row(values[0][row_num]);
+                static_for<N - 1>([&](auto i) { frame.add_to_row(values[i + 1][row_num]); });
+            });
+            return;
+        }
+        RowNumbers::foreach(rows,
+                [&frame, &columns_ = columns_, columns_count, &columns]
+                (i64 row_num) {
+            frame.new_row(columns_[columns[0]]->at(row_num));
+            for (auto const i : IntRange(1, columns_count))
+                frame.add_to_row(columns_[columns[i]]->at(row_num));
+        });
     });
 }
 // }}}
@@ -481,6 +1178,15 @@ public:
                 return true;
         return false;
     }
+    vector<ValueInterval> const& intervals() const noexcept { return intervals_; }
+    index_t column_id() const noexcept { return col_.id(); }
+    value_t const* data() const noexcept { return col_.ref().data(); }
+    void prefetch(RowRange const& rows) const noexcept { col_.ref().prefetch(rows); }
+    // the same predicate over another table with the same columns
+    ColumnPredicate bind(Table const& tbl) const { return ColumnPredicate(ColumnHandle(tbl, col_.id()), intervals_); }
+    bool matches_all() const noexcept {
+        return isize(intervals_) == 1 && intervals_.front().l_infinity() && intervals_.front().r_infinity();
+    }
     string _repr() const { return make_repr("ColumnPredicate", {"column", "intervals"}, col_, intervals_); }
 private:
     const ColumnHandle col_;
@@ -557,17 +1263,44 @@ public:
 
         return AfterRangeScan(move(not_scanned), move(rows_to_rangescan), md_.key_len());
     }
+    void perform_full_scan(RowRange const& rows, IntRange const& columns, RowNumbersEraser& eraser) const {
+        auto const restricted = restricted_(columns);
+        bool single_intervals = true;
+        for (auto const c : restricted)
+            single_intervals &= isize(preds_[c].intervals()) == 1;
+        if (single_intervals) {
+            bool done = false;
+            dispatch_count<max_static_columns>(isize(restricted), [&](auto n) {
+                if constexpr (decltype(n)::value != dynamic_count) {
+                    perform_full_scan_<decltype(n)::value>(rows, restricted, eraser);
+                    done = true;
+                }
+            });
+            if (done)
+                return;
+        }
+        for (auto const i : rows) {
+            bool can_stay = true;
+            for (auto const c : restricted)
+                can_stay &= preds_[c].match_row_id(i);
+            if (can_stay)
+                eraser.keep(i);
+        }
+    }
+    // for out-of-core tables, pages of scanned columns are read ahead
+    void prefetch(RowRange const& rows, IntRange const& columns) const {
+        for (auto const c : restricted_(columns))
+            preds_[c].prefetch(rows);
+    }
     RowNumbers perform_full_scan(RowRange const& rows, IntRange const& columns) const {
+        // e.g. aggregates over a range of the key are answered without reading the rows
+        if (!restricts(columns))
+            return RowNumbers(rows);
+        prefetch(rows, columns);
         RowNumbers row_numbers(rows);
         {
             RowNumbersEraser eraser(row_numbers); // todo: eraser -> builder
-            for (auto const i : row_numbers.as_range()) {
-                bool can_stay = true;
-                for (auto const c : columns)
-                    can_stay &= preds_[c].match_row_id(i);
-                if (can_stay)
-                    eraser.keep(i);
-            }
+            perform_full_scan(row_numbers.as_range(), columns, eraser);
         }
         return row_numbers;
     }
@@ -578,6 +1311,55 @@ public:
                            IntRange(request.first_column, md_.columns_count())));
         return outp;
     }
+    IntRange fullscan_columns(FullscanRequest const& request) const
+        { return IntRange(request.first_column, md_.columns_count()); }
+    // whether rows can fail to match in the columns, otherwise a full scan keeps all of them
+    bool restricts(IntRange const& columns) const { return !restricted_(columns).empty(); }
+    // values of the whole key, if every key column is restricted to exactly one value
+    std::optional<vi64> point_key() const {
+        if (md_.key_len() == 0)
+            return std::nullopt;
+        vi64 key;
+        for (auto const c : md_.key_columns()) {
+            auto const& intervals = preds_[c].intervals();
+            if (isize(intervals) != 1 || !intervals.front().is_single_value())
+                return std::nullopt;
+            key.push_back(intervals.front().l());
+        }
+        return key;
+    }
+    // whether rows with the first key column in [lo, hi] can match
+    bool first_key_overlaps(value_t lo, value_t hi) const {
+        if (md_.key_len() == 0)
+            return true;
+        auto const& intervals = preds_.front().intervals();
+        return std::any_of(intervals.begin(), intervals.end(), [&](auto const& v) { return v.overlaps(lo, hi); });
+    }
+    // columns read by the predicate
+    indices_t columns() const { return restricted_(md_.columns()); }
+    TablePredicate bind(Table const& tbl) const
+        { return TablePredicate(tbl.metadata(), fun::map(preds_, [&tbl](auto const& p) { return p.bind(tbl); })); }
+    // the same for all predicates matching the same rows, as far as organized intervals tell
+    string normalized() const {
+        string s;
+        for (auto const& pred : preds_)
+            if (!pred.matches_all())
+                s += str(pred.column_id()) + '=' + str(pred.intervals()) + ';';
+        return s;
+    }
+    // like normalized(), but only tells which columns are restricted to single values or to ranges
+    string shape() const {
+        string s;
+        for (auto const& pred : preds_) {
+            if (pred.matches_all())
+                continue;
+            auto const& intervals = pred.intervals();
+            auto const single = std::all_of(intervals.begin(), intervals.end(),
+                    [](auto const& v) { return v.is_single_value(); });
+            s += str(pred.column_id()) + (single ? '=' : '~') + ';';
+        }
+        return s;
+    }
     string _repr() const {
         auto s = "TablePredicate(\n"s;
         for (auto const& pred : preds_)
@@ -585,41 +1367,287 @@ public:
         return s + ')';
     }
 private:
+    // N columns restricted to one interval each, compared branch-free
+    template <i64 N>
+    void perform_full_scan_(RowRange const& rows, indices_t const& restricted, RowNumbersEraser& eraser) const {
+        std::array<value_t const*, N> values;
+        std::array<value_t, N> lo, hi;
+        for (auto const k : IntRange(0, N)) {
+            auto const& pred = preds_[restricted[k]];
+            values[k] = pred.data();
+            std::tie(lo[k], hi[k]) = pred.intervals().front().closed();
+        }
+        for (auto const i : rows) {
+            bool can_stay = true;
+            static_for<N>([&](auto k) { can_stay &= (lo[k] <= values[k][i]) & (values[k][i] <= hi[k]); });
+            if (can_stay)
+                eraser.keep(i);
+        }
+    }
+    // columns which rows can fail to match, the others aren't read at all
+    indices_t restricted_(IntRange const& columns) const {
+        indices_t res;
+        for (auto const c : columns)
+            if (!preds_[c].matches_all())
+                res.push_back(c);
+        return res;
+    }
     Metadata const& md_;
     vector<ColumnPredicate> preds_;
 };
 struct Query {
     TablePredicate where_pred;
     columns_t select_cols;
+    Query bind(Table const& tbl) const {
+        return Query{where_pred.bind(tbl), fun::map(select_cols, [&tbl](auto const& c) { return ColumnHandle(tbl, c.id()); })};
+    }
+    // columns read by the query
+    indices_t columns() const {
+        auto res = where_pred.columns();
+        for (auto const& c : select_cols)
+            res.push_back(c.id());
+        return res;
+    }
+    string normalized() const { return where_pred.normalized() + " select " + select_ids_(); }
+    string shape() const { return where_pred.shape() + " select " + select_ids_(); }
     string _repr() const { return make_repr("Query", {"where_preds", "select_cols"}, where_pred, select_cols); }
+private:
+    string select_ids_() const { return fun::join(select_cols, ',', [](auto const& col) { return str(col.id()); }); }
+};
+// profiles of query execution stages
+struct QueryStages {
+    QueryStages(HwCounters const* hw0 = nullptr) : hw(hw0) {}
+    StageMeasure measure(StageProfile& stage) const { return StageMeasure(stage, hw); }
+    std::array<StageProfile const*, 4> all() const { return {&parse, &range_scan, &full_scan, &write}; }
+    QueryStages& operator+=(QueryStages const& other) {
+        parse += other.parse;
+        range_scan += other.range_scan;
+        full_scan += other.full_scan;
+        write += other.write;
+        return *this;
+    }
+    HwCounters const* hw;
+    StageProfile parse{"parse"}, range_scan{"range_scan"}, full_scan{"full_scan"}, write{"write"};
 };
 // }}}
+class SharedScan { // {{{
+public:
+    // rows per block, so that a block of every scanned column stays in cache
+    static constexpr i64 block_rows = 4096;
+    void add(TablePredicate const& pred, vector<FullscanRequest> const& requests) {
+        preds_.push_back(&pred);
+        requests_.push_back(&requests);
+    }
+    // Full scans of all added queries are done in one pass: the table is walked block by block,
+    // and every request overlapping the block is evaluated before moving on.
+    // Results are indexed like the requests: result[query][request].
+    vector<vector<RowNumbers>> run() const {
+        vector<vector<RowNumbers>> result(preds_.size());
+        vector<std::tuple<RowRange, i64, i64>> tasks;
+        for (auto const q : IntRange(0, isize(preds_))) {
+            for (auto const& request : *requests_[q]) {
+                // all rows of requests restricting no column stay
+                if (preds_[q]->restricts(preds_[q]->fullscan_columns(request)))
+                    tasks.emplace_back(request.rows, q, isize(result[q]));
+                result[q].emplace_back(request.rows);
+            }
+        }
+        fun::sort(tasks);
+        log_plan("Shared scan:", isize(tasks), "requests of", isize(preds_), "queries");
+        {
+            vector<std::unique_ptr<RowNumbersEraser>> erasers;
+            for (auto const& [rows, q, i] : tasks)
+                erasers.push_back(std::make_unique<RowNumbersEraser>(result[q][i]));
+            std::list<i64> active;
+            auto next_task = tasks.begin();
+            for (index_t block_l = 0; next_task != tasks.end() || !active.empty(); block_l += block_rows) {
+                if (active.empty())
+                    block_l = std::max(block_l, std::get<0>(*next_task).l());
+                auto const block = RowRange(block_l, block_l + block_rows - 1);
+                for (; next_task != tasks.end() && std::get<0>(*next_task).l() <= block.r(); ++next_task) {
+                    auto const& [rows, q, i] = *next_task;
+                    preds_[q]->prefetch(rows, preds_[q]->fullscan_columns((*requests_[q])[i]));
+                    active.push_back(next_task - tasks.begin());
+                }
+                for (auto it = active.begin(); it != active.end();) {
+                    auto const& [rows, q, i] = tasks[*it];
+                    auto const part = RowRange(std::max(rows.l(), block.l()), std::min(rows.r(), block.r()));
+                    preds_[q]->perform_full_scan(part, preds_[q]->fullscan_columns((*requests_[q])[i]),
+                            *erasers[*it]);
+                    it = rows.r() <= block.r() ? active.erase(it) : std::next(it);
+                }
+            }
+        }
+        return result;
+    }
+private:
+    vector<TablePredicate const*> preds_;
+    vector<vector<FullscanRequest> const*> requests_;
+}; // }}}
+class PointLookupBatch { // {{{
+public:
+    PointLookupBatch(Table const& table) : table_(table) {}
+    // Keys are resolved in sorted order. Each descent starts from the deepest range shared with
+    // the previous key, and in the first differing column it searches only behind the previous match.
+    vector<RowRange> resolve(vector<vi64> const& keys) const {
+        auto const key_len = table_.metadata().key_len();
+        indices_t order(keys.size());
+        std::iota(order.begin(), order.end(), 0);
+        fun::sort(order, [&keys](auto const a, auto const b) { return vector_less(keys[a], keys[b]); });
+        vector<RowRange> result(keys.size());
+        vector<RowRange> levels(key_len + 1, table_.row_range());
+        vi64 const* prev = nullptr;
+        for (auto const idx : order) {
+            auto const& key = keys[idx];
+            massert2(isize(key) == key_len);
+            i64 depth = 0;
+            while (prev && depth < key_len && key[depth] == (*prev)[depth])
+                ++depth;
+            for (auto const d : IntRange(depth, key_len)) {
+                auto rng = levels[d];
+                if (prev && d == depth)
+                    rng = RowRange(std::max(rng.l(), levels[d + 1].r() + 1), rng.r());
+                levels[d + 1] = table_.column(d)->equal_range(rng, key[d]);
+            }
+            result[idx] = levels[key_len];
+            prev = &key;
+        }
+        return result;
+    }
+private:
+    Table const& table_;
+}; // }}}
 class TablePlayground { // {{{
 public:
-    TablePlayground(Table & table) : table_(table) {}
-    void run(Query const& q, OutputFrame & outp) {
-        auto const after_range = q.where_pred.perform_range_scan(table_.row_range());
+    TablePlayground(Table const& table) : table_(table) {}
+    void run(Query const& q, OutputFrame & outp) const {
+        table_.write(q.select_cols, select_rows(q), outp);
+    }
+    vector<RowNumbers> select_rows(Query const& q) const {
+        QueryStages stages;
+        return select_rows(q, stages);
+    }
+    vector<RowNumbers> select_rows(Query const& q, QueryStages& stages,
+            vector<FullscanRequest>* fullscan_requests = nullptr) const {
+        auto const after_range = [&] {
+            auto const m = stages.measure(stages.range_scan);
+            if (auto const key = q.where_pred.point_key(); key && !may_contain_(*key))
+                return AfterRangeScan({}, {}, table_.metadata().key_len());
+            return q.where_pred.perform_range_scan(table_.row_range());
+        }();
 #ifdef PLAN_PRINTS
         for (auto const& after_range_elem : after_range.fullscan_requests())
             log_plan("Range scan result:", str(after_range_elem));
 #endif
-        auto const rows = q.where_pred.perform_full_scan(after_range.fullscan_requests());
+        auto rows = [&] {
+            auto const m = stages.measure(stages.full_scan);
+            return q.where_pred.perform_full_scan(after_range.fullscan_requests());
+        }();
         log_plan("Full scan result:", str(rows));
-        table_.write(q.select_cols, rows, outp);
+        count_rows_(stages, 1, {&q.where_pred}, {&after_range}, {&rows});
+        if (fullscan_requests)
+            *fullscan_requests = after_range.fullscan_requests();
+        return rows;
+    }
+    // exact-key lookups share one sorted descent, full scans of the rest share one pass over the table
+    vector<vector<RowNumbers>> select_rows(vector<Query> const& queries, QueryStages& stages) const {
+        vector<vector<RowNumbers>> result(queries.size());
+        vector<vi64> keys;
+        indices_t point_queries;
+        indices_t scan_queries;
+        vector<AfterRangeScan> after_range;
+        auto const key_len = table_.metadata().key_len();
+        {
+            auto const m = stages.measure(stages.range_scan);
+            for (auto const i : IntRange(0, isize(queries))) {
+                if (auto key = queries[i].where_pred.point_key()) {
+                    keys.push_back(move(*key));
+                    point_queries.push_back(i);
+                } else {
+                    after_range.push_back(queries[i].where_pred.perform_range_scan(table_.row_range()));
+                    scan_queries.push_back(i);
+                }
+            }
+            log_plan("Batch:", isize(point_queries), "point lookups out of", isize(queries), "queries");
+            // keys missing from the filter aren't searched
+            vector<RowRange> ranges(keys.size(), RowRange::make_empty());
+            vector<vi64> maybe_keys;
+            indices_t maybe;
+            for (auto const i : IntRange(0, isize(keys))) {
+                if (may_contain_(keys[i])) {
+                    maybe_keys.push_back(move(keys[i]));
+                    maybe.push_back(i);
+                }
+            }
+            auto const maybe_ranges = PointLookupBatch(table_).resolve(maybe_keys);
+            for (auto const i : IntRange(0, isize(maybe)))
+                ranges[maybe[i]] = maybe_ranges[i];
+            for (auto const i : IntRange(0, isize(point_queries)))
+                after_range.emplace_back(vector<FullscanRequest>{FullscanRequest(ranges[i], key_len)},
+                        vector<RowRange>{}, key_len);
+        }
+        {
+            auto const m = stages.measure(stages.full_scan);
+            SharedScan shared_scan;
+            for (auto const i : IntRange(0, isize(scan_queries)))
+                shared_scan.add(queries[scan_queries[i]].where_pred, after_range[i].fullscan_requests());
+            auto scanned = shared_scan.run();
+            for (auto const i : IntRange(0, isize(scan_queries)))
+                result[scan_queries[i]] = move(scanned[i]);
+            for (auto const i : IntRange(0, isize(point_queries))) {
+                auto const& q = queries[point_queries[i]];
+                result[point_queries[i]] = q.where_pred.perform_full_scan(
+                        after_range[isize(scan_queries) + i].fullscan_requests());
+            }
+        }
+        vector<TablePredicate const*> preds;
+        for (auto const i : scan_queries)
+            preds.push_back(&queries[i].where_pred);
+        for (auto const i : point_queries)
+            preds.push_back(&queries[i].where_pred);
+        count_rows_(stages, isize(queries), preds, fun::map(after_range, [](auto const& a) { return &a; }),
+                fun::map(result, [](auto const& r) { return &r; }));
+        return result;
     }
-    void validate() const {
+    // rows are numbered from first_row in errors
+    void validate(index_t first_row = 0) const {
         vi64 prev_value;
         for (auto const i : table_.row_range()) {
             vi64 current_value;
             for (auto const j : table_.key_columns())
                 current_value.push_back(table_.column(j)->at(i));
             table_check(i == 0 || !vector_less(current_value, prev_value),
-                "key of row",  i, "is lesser than previous row");
+                "key of row",  first_row + i, "is lesser than previous row");
             prev_value = move(current_value);
         }
     }
 private:
-    Table& table_;
+    bool may_contain_(vi64 const& key) const {
+        auto const filter = table_.key_filter();
+        if (!filter || filter->may_contain(key))
+            return true;
+        ++op_counters.filtered_lookups;
+        return false;
+    }
+    // preds[i] is the predicate of after_range[i], rows it doesn't restrict aren't scanned
+    void count_rows_(QueryStages& stages, i64 queries_count, vector<TablePredicate const*> const& preds,
+            vector<AfterRangeScan const*> const& after_range, vector<vector<RowNumbers> const*> const& rows) const {
+        i64 to_full_scan = 0, scanned = 0;
+        for (auto const i : IntRange(0, isize(after_range))) {
+            for (auto const& request : after_range[i]->fullscan_requests()) {
+                to_full_scan += request.rows.len();
+                if (preds[i]->restricts(preds[i]->fullscan_columns(request)))
+                    scanned += request.rows.len();
+            }
+        }
+        stages.range_scan.rows_in += queries_count * table_.rows_count();
+        stages.range_scan.rows_out += to_full_scan;
+        stages.full_scan.rows_in += scanned;
+        for (auto const r : rows)
+            for (auto const& row_numbers : *r)
+                stages.full_scan.rows_out += row_numbers.count();
+    }
+    Table const& table_;
 }; // }}}
 class PredOp { // {{{
 public:
@@ -701,113 +1729,2261 @@ private:
     vector<RangePredBuilder> preds_;
 }; // }}}
 // parse {{{
-Query parse(const Table& tbl, const string line) {
-    TablePredicateBuilder where_builder(tbl.metadata());
-    columns_t select_builder;
-    // todo: select_builder: use metadata instead of table
-    std::stringstream ss(line);
-    string token;
-    query_format_check(!ss.eof(), "empty line");
-    ss >> token;
-    query_format_check(token == "select", "no select at the beginning");
-    {
-        bool no_comma = true;
-        while (no_comma && !ss.eof()) {
-            ss >> token;
-            if (token.back() != ',')
-                no_comma = false;
-            else
-                token.pop_back();
-            if (token != "*")
-                select_builder.emplace_back(tbl, token);
-            else
-                for (auto const& id : tbl.metadata().columns())
-                    select_builder.emplace_back(tbl, tbl.metadata().column_name(id));
+// "from" clause: the queried table, and optionally a table joined with it on leading key columns.
+// Empty table name means the default table.
+struct FromClause {
+    string table;
+    string joined;
+    cnames join_on;
+};
+// Splits a query into the select list, "from" clause, where list and "group by" list. Column names
+// are resolved by the caller, once it knows the tables from the "from" clause.
+class QueryParser {
+public:
+    QueryParser(string const& line) : ss_(line) {
+        query_format_check(!ss_.eof(), "empty line");
+        ss_ >> token_;
+        query_format_check(token_ == "select", "no select at the beginning");
+        if (!ss_.eof()) {
+            auto const pos = ss_.tellg();
+            ss_ >> token_;
+            distinct_ = token_ == "distinct";
+            if (!distinct_)
+                ss_.seekg(pos);
         }
-        query_format_check(!select_builder.empty(), "select list empty");
-        query_format_check(!no_comma, "no comma after select list");
-    }
-    if (ss.eof()) {
-        return Query{where_builder.build(tbl), move(select_builder)};
+        parse_list_("select", [this](string const& token) { select_.push_back(token); });
+        next_token_();
+        if (has_token_ && token_ == "from")
+            parse_from_();
+        grouped_ = distinct_ || has_group_by_();
+        for (auto const& token : select_)
+            grouped_ = grouped_ || token.find('(') != string::npos;
     }
-    ss >> token;
-    query_format_check(token == "where", "something else than 'where' after select list: " + token);
-    {
-        bool where_non_empty = false;
-        bool no_comma = true;
-        while (no_comma && !ss.eof()) {
-            where_non_empty = true;
-            ss >> token;
-            if (token.back() != ',')
-                no_comma = false;
-            else
-                token.pop_back();
+    FromClause const& from() const noexcept { return from_; }
+    vstr const& select() const noexcept { return select_; }
+    bool distinct() const noexcept { return distinct_; }
+    // the query has "distinct", "group by" or aggregates, known before the where list is parsed
+    bool grouped() const noexcept { return grouped_; }
+    // filled by parse_where()
+    cnames const& group_by() const noexcept { return group_by_; }
+    // calls f(column name, operator, value) for every predicate of the where list, then reads the
+    // "group by" list
+    template <class F>
+    void parse_where(F f) {
+        if (!has_token_)
+            return;
+        if (token_ == "group") {
+            parse_group_by_();
+            return;
+        }
+        query_format_check(token_ == "where", "something else than 'where' after select list: " + token_);
+        parse_list_("where", [&f](string const& token) {
             const auto sep_pos = token.find_first_of("=<>");
             query_format_check(sep_pos != string::npos, "<>= not found");
             const auto col = token.substr(0, sep_pos);
             const auto sep = PredOp(string(1, token[sep_pos]));
             const auto val = token.substr(sep_pos + 1, isize(token) - sep_pos - 1);
-            where_builder.add_pred(col, sep, val);
+            f(col, sep, val);
+        });
+        next_token_();
+        if (!has_token_)
+            return;
+        query_format_check(token_ == "group", "there's something after 'where': " + token_);
+        parse_group_by_();
+    }
+private:
+    // comma-separated list, calls f for every element
+    template <class F>
+    void parse_list_(string const& name, F f) {
+        bool non_empty = false;
+        bool no_comma = true;
+        while (no_comma && !ss_.eof()) {
+            non_empty = true;
+            ss_ >> token_;
+            if (token_.back() != ',')
+                no_comma = false;
+            else
+                token_.pop_back();
+            f(token_);
         }
-        query_format_check(where_non_empty, "where list empty");
-        query_format_check(!no_comma, "no comma after where list");
+        query_format_check(non_empty, name + " list empty");
+        query_format_check(!no_comma, "no comma after " + name + " list");
+    }
+    void parse_from_() {
+        from_.table = read_name_("from");
+        next_token_();
+        if (!has_token_ || token_ != "join")
+            return;
+        from_.joined = read_name_("join");
+        next_token_();
+        query_format_check(has_token_ && token_ == "on", "no 'on' after joined table");
+        parse_list_("join", [this](string const& token) { from_.join_on.push_back(token); });
+        next_token_();
+    }
+    string read_name_(string const& after) {
+        string name;
+        if (!ss_.eof())
+            ss_ >> name;
+        query_format_check(!name.empty(), "no table name after '" + after + "'");
+        return name;
     }
-    ss >> std::ws;
-    if (ss.eof()) {
-        return Query{where_builder.build(tbl), move(select_builder)};
+    void parse_group_by_() {
+        next_token_();
+        query_format_check(has_token_ && token_ == "by", "no 'by' after 'group'");
+        parse_list_("group by", [this](string const& token) { group_by_.push_back(token); });
+        next_token_();
+        query_format_check(!has_token_, "there's something after 'group by': " + token_);
     }
-    ss >> token;
-    throw query_format_error("there's something after 'where': " + token);
+    // looks ahead for "group", which can't be a column name or a predicate
+    bool has_group_by_() {
+        if (!has_token_)
+            return false;
+        if (token_ == "group")
+            return true;
+        if (ss_.eof())
+            return false;
+        auto const pos = ss_.tellg();
+        bool found = false;
+        for (string token; !found && ss_ >> token;)
+            found = token == "group";
+        ss_.clear();
+        ss_.seekg(pos);
+        return found;
+    }
+    void next_token_() {
+        ss_ >> std::ws;
+        has_token_ = !ss_.eof();
+        if (has_token_)
+            ss_ >> token_;
+    }
+    std::stringstream ss_;
+    string token_;
+    // token_ was read, but not consumed yet
+    bool has_token_ = false;
+    vstr select_;
+    FromClause from_;
+    bool distinct_ = false;
+    bool grouped_ = false;
+    cnames group_by_;
+};
+Query parse(const Table& tbl, QueryParser& parser) {
+    query_semantics_check(!parser.grouped(), "group by and distinct are only supported in single queries");
+    TablePredicateBuilder where_builder(tbl.metadata());
+    columns_t select_builder;
+    // todo: select_builder: use metadata instead of table
+    for (auto const& token : parser.select()) {
+        if (token != "*")
+            select_builder.emplace_back(tbl, token);
+        else
+            for (auto const& id : tbl.metadata().columns())
+                select_builder.emplace_back(tbl, tbl.metadata().column_name(id));
+    }
+    parser.parse_where([&](auto const& col, auto const& sep, auto const& val) { where_builder.add_pred(col, sep, val); });
+    return Query{where_builder.build(tbl), move(select_builder)};
+}
+Query parse(const Table& tbl, const string line) {
+    QueryParser parser(line);
+    return parse(tbl, parser);
 }
 // parse }}}
-// main loop {{{
-struct CmdArgs {
-    string filename;
+// table store {{{
+// a row of a file and the byte offset its values start at, see scan_table()
+struct RowOffset {
+    index_t row = 0;
+    i64 byte = 0;
 };
-void main_loop(const CmdArgs& args) {
-    std::ifstream ifs(args.filename);
-    table_check(!ifs.fail(), "couldn't open database file " + args.filename);
+// Rows before the given offset aren't parsed at all, the following ones are skipped up to the range.
+Table read_table(string const& filename, RowRange rows = RowRange(0, std::numeric_limits<index_t>::max() - 1),
+        std::optional<indices_t> const& columns = std::nullopt, RowOffset start = {}) {
+    massert2(start.row <= rows.l());
+    std::ifstream ifs(filename);
+    table_check(!ifs.fail(), "couldn't open database file " + filename);
+    InputFrame file(ifs, start.byte);
+    return Table::read(file, RowRange(rows.l() - start.row, rows.r() - start.row), columns);
+}
+// tables are named after their files, without directory and extension
+string table_name(string const& filename) { return std::filesystem::path(filename).stem().string(); }
+// Out-of-core tables: every column is kept in "<dir>/<table name>.<column number>.bin" as raw values and
+// mapped into memory. The files are written from the csv file once, and reused while they're newer.
+Table map_table(string const& filename, string const& dir) {
+    namespace fs = std::filesystem;
+    std::ifstream ifs(filename);
+    table_check(!ifs.fail(), "couldn't open database file " + filename);
     InputFrame file(ifs);
-    auto tbl = Table::read(file);
-    TablePlayground t(tbl);
-#ifndef NO_VALIDATION
-    try {
-        t.validate();
-    } catch (table_error const& exc) {
-        println("table error:", std::string(exc.what()));
-        exit(26);
+    auto md = file.get_metadata();
+    auto const path = [&](i64 c) { return fs::path(dir) / (table_name(filename) + "." + str(c) + ".bin"); };
+    std::error_code ec;
+    bool up_to_date = true;
+    for (auto const c : md.columns())
+        up_to_date = up_to_date && fs::exists(path(c), ec)
+            && fs::last_write_time(path(c), ec) >= fs::last_write_time(filename, ec);
+    if (!up_to_date) {
+        auto const tmp_path = [&](i64 c) { return path(c).string() + ".tmp"; };
+        {
+            vector<std::ofstream> outs;
+            for (auto const c : md.columns()) {
+                outs.emplace_back(tmp_path(c), std::ios::binary);
+                table_check(outs.back().good(), "couldn't write column file " + tmp_path(c));
+            }
+            auto out_it = outs.begin();
+            for (auto elem = *file; !file.end(); elem = *(++file)) {
+                out_it->write(reinterpret_cast<char const*>(&elem), sizeof(elem));
+                if (++out_it == outs.end()) out_it = outs.begin();
+            }
+            table_check(out_it == outs.begin(), "couldn't read the same number of values for each column");
+            for (auto& out : outs) {
+                out.flush();
+                table_check(out.good(), "couldn't write column files to " + dir);
+            }
+        }
+        // tables mapped before keep the replaced files
+        for (auto const c : md.columns())
+            fs::rename(tmp_path(c), path(c));
+        log_info("wrote column files of", table_name(filename), "to", dir);
     }
-#endif
-    string line;
-    i64 count = 0;
-    while (std::getline(std::cin, line)) {
+    vector<IntColumn::ptr> columns;
+    for (auto const c : md.columns()) {
+        columns.push_back(IntColumn::map(path(c).string()));
+        columns.back()->name() = md.column_name(c);
+        table_check(columns.back()->rows_count() == columns.front()->rows_count(),
+                "column files of different lengths in " + dir);
+    }
+    return Table(move(md), move(columns));
+}
+// Merged out-of-core table: columns are written to new files in dir, which are mapped and unlinked right
+// away, so they go away with the last table using them and can't be mistaken for columns of the csv file.
+Table merge_to_files(Table const& main, Table const& delta, string const& dir, string const& name) {
+    namespace fs = std::filesystem;
+    auto const runs = main.merge_runs(delta);
+    vector<IntColumn::ptr> columns;
+    for (auto const c : main.columns()) {
+        auto path = (fs::path(dir) / (name + "." + str(c) + ".merge.XXXXXX")).string();
+        auto const fd = mkstemp(path.data());
+        table_check(fd >= 0, "couldn't create column file in " + dir);
+        close(fd);
+        // the file is removed once mapped, or on failure
+        std::error_code ec;
         try {
-            auto q = parse(tbl, line);
-            Measure mes(str(++count));
-            log_info("query:", line);
-            dprintln(repr(q));
-            println("query number:", count);
-            OutputFrame outp(std::cout);
-            t.run(q, outp);
-            dprintln();
-        } catch (const data_error& e) {
-            dprintln();
-            println("query error:", std::string(e.what()));
+            std::ofstream out(path, std::ios::binary);
+            for (auto const& [tbl, rows] : runs)
+                out.write(reinterpret_cast<char const*>(tbl->column(c)->data() + rows.l()),
+                        rows.len() * i64(sizeof(value_t)));
+            out.flush();
+            table_check(out.good(), "couldn't write column files to " + dir);
+            columns.push_back(IntColumn::map(path));
+        } catch (...) {
+            fs::remove(path, ec);
+            throw;
         }
+        columns.back()->name() = main.metadata().column_name(c);
+        fs::remove(path, ec);
     }
+    return Table(main.metadata(), move(columns));
 }
-// }}}
-// cmdline {{{
-void quit([[maybe_unused]] std::string msg) {
-    log_info(msg, "- exiting");
-    exit(13);
-}
-CmdArgs validate(int argc, char** argv) {
-    if (argc != 2)
-        quit("one argument required: path to the csv file, tab-separated, with \"-escape character");
-    return {std::string(argv[1])};
-}
-int main(int argc, char** argv) {
-    main_loop(validate(argc, argv));
+// how tables are kept in memory
+struct StoreOptions {
+    bool row_store = false;
+    std::chrono::seconds merge_interval{60};
+    // out-of-core tables, see map_table()
+    string column_dir;
+    // only key columns are read upfront, the rest when a query needs them, see TableStore::snapshot()
+    bool lazy_columns = false;
+    // bytes of lazily loaded columns, 0 for no limit
+    i64 memory_budget = 0;
+    // columns with RangeAggregates, in every table having them
+    cnames range_aggregates;
+    bool key_filter = false;
+};
+// tells whether a file has been modified or replaced since it was read
+struct FileIdentity {
+    dev_t device = 0;
+    ino_t inode = 0;
+    i64 size = 0;
+    i64 mtime_ns = 0;
+    static FileIdentity of(string const& filename) {
+        struct stat st;
+        table_check(stat(filename.c_str(), &st) == 0, "couldn't open database file " + filename);
+        return {st.st_dev, st.st_ino, i64(st.st_size), i64(st.st_mtim.tv_sec) * 1'000'000'000 + st.st_mtim.tv_nsec};
+    }
+    bool operator==(FileIdentity const& other) const noexcept {
+        return std::tie(device, inode, size, mtime_ns) ==
+            std::tie(other.device, other.inode, other.size, other.mtime_ns);
+    }
+    bool operator!=(FileIdentity const& other) const noexcept { return !(*this == other); }
+};
+Table load_table(string const& filename, StoreOptions const& options) {
+    if (!options.column_dir.empty())
+        return map_table(filename, options.column_dir);
+    if (options.lazy_columns)
+        return read_table(filename, RowRange(0, std::numeric_limits<index_t>::max() - 1), indices_t());
+    return read_table(filename);
 }
+// metadata and number of rows of a file, without keeping the values
+struct ScannedTable {
+    static constexpr i64 offset_rows = 4096;
+    Metadata md;
+    i64 rows = 0;
+    // of every offset_rows-th row, except for the first one
+    vector<i64> offsets;
+    // the nearest row at or before the given one, to start reading it from
+    RowOffset offset_before(index_t row) const {
+        auto const i = std::min(row / offset_rows, isize(offsets));
+        return i == 0 ? RowOffset{} : RowOffset{i * offset_rows, offsets[i - 1]};
+    }
+};
+ScannedTable scan_table(string const& filename) {
+    std::ifstream ifs(filename);
+    table_check(!ifs.fail(), "couldn't open database file " + filename);
+    InputFrame file(ifs);
+    ScannedTable res{file.get_metadata(), 0, {}};
+    auto const offset_values = ScannedTable::offset_rows * res.md.columns_count();
+    i64 values = 0;
+    for (; !file.end(); ++file) {
+        // the next value, read by ++file, is the first one of a row
+        if (++values % offset_values == 0)
+            res.offsets.push_back(ifs.tellg());
+    }
+    table_check(values % res.md.columns_count() == 0, "couldn't read the same number of values for each column");
+    res.rows = values / res.md.columns_count();
+    return res;
+}
+// Immutable state of the data: the main table and sorted delta segments with rows inserted since
+// the last merge, oldest first. Holding a snapshot keeps its tables alive.
+struct Snapshot {
+    std::shared_ptr<const Table> main;
+    vector<std::shared_ptr<const Table>> deltas;
+    i64 version = 0;
+    vector<Table const*> segments() const {
+        vector<Table const*> res = {main.get()};
+        for (auto const& d : deltas)
+            res.push_back(d.get());
+        return res;
+    }
+    // rows[segment] are results of the query in the segment, f(table, row) is called for all of them
+    // in key order
+    template <class F>
+    void foreach_row(vector<vector<RowNumbers>> const& rows, F f) const {
+        massert2(isize(rows) == isize(deltas) + 1);
+        if (deltas.empty()) {
+            RowNumbers::foreach(rows.front(), [&](index_t r) { f(*main, r); });
+            return;
+        }
+        // delta rows are few: they're gathered and sorted, then interleaved with the streamed main table rows
+        auto const delta_rows = sorted_delta_rows(rows);
+        auto next = delta_rows.begin();
+        RowNumbers::foreach(rows.front(), [&](index_t r) {
+            for (; next != delta_rows.end() && next->first->key_less(next->second, *main, r); ++next)
+                f(*next->first, next->second);
+            f(*main, r);
+        });
+        for (; next != delta_rows.end(); ++next)
+            f(*next->first, next->second);
+    }
+    // results of the query in delta segments, in key order, older segments first among equal keys
+    vector<std::pair<Table const*, index_t>> sorted_delta_rows(vector<vector<RowNumbers>> const& rows) const {
+        vector<std::pair<Table const*, index_t>> res;
+        for (auto const i : IntRange(0, isize(deltas)))
+            RowNumbers::foreach(rows[i + 1], [&](index_t r) { res.emplace_back(deltas[i].get(), r); });
+        std::stable_sort(res.begin(), res.end(), [](auto const& a, auto const& b)
+                { return a.first->key_less(a.second, *b.first, b.second); });
+        return res;
+    }
+    void write(columns_t const& select, vector<vector<RowNumbers>> const& rows, OutputFrame& frame) const {
+        if (deltas.empty()) {
+            main->write(select, rows.front(), frame);
+            return;
+        }
+        frame.add_header(fun::map(select, [](auto const& c) { return c.ref().name(); }));
+        auto const ids = fun::map(select, [](auto const& c) { return c.id(); });
+        foreach_row(rows, [&](Table const& tbl, index_t r) { tbl.write_row(ids, r, frame); });
+    }
+};
+// Owns the current snapshot. Inserted rows are buffered until the next snapshot, which turns them into
+// a delta segment; deltas are merged into a new main table by a background thread every merge_interval
+// (or on demand) and swapped in.
+class TableStore {
+public:
+    // the table was loaded from the file with load_table(), file is taken before loading
+    TableStore(Table tbl, string filename, StoreOptions options, FileIdentity file)
+            : md_(tbl.metadata()), options_(move(options)), filename_(move(filename)), file_(file),
+              last_use_(md_.columns_count(), 0) {
+        build_indexes_(tbl);
+        current_.main = std::make_shared<const Table>(move(tbl));
+        if (options_.merge_interval.count() > 0)
+            merger_ = std::thread([this] { merge_loop_(); });
+    }
+    TableStore(TableStore const&) = delete;
+    TableStore& operator=(TableStore const&) = delete;
+    ~TableStore() {
+        {
+            std::lock_guard lock(reload_mtx_);
+            if (reload_.valid())
+                reload_.wait();
+        }
+        {
+            std::lock_guard lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (merger_.joinable())
+            merger_.join();
+    }
+    Snapshot snapshot() {
+        freeze_();
+        std::lock_guard lock(mtx_);
+        return current_;
+    }
+    // The current snapshot, with given columns loaded into the main table. Missing columns of a lazily
+    // loaded table are read from the file in one pass, then the least recently used columns are evicted
+    // until loaded ones fit into the memory budget, except for key columns and the given ones. Queries
+    // holding older snapshots keep the evicted columns alive. If the file has changed since the table was
+    // loaded, the query fails and the table is reloaded.
+    Snapshot snapshot(indices_t const& columns) {
+        freeze_();
+        std::unique_lock lock(mtx_);
+        for (auto const c : columns)
+            last_use_[c] = ++use_clock_;
+        if (current_.main->loaded(columns))
+            return current_;
+        lock.unlock();
+        // concurrent queries usually miss the same columns, they wait for a single load
+        std::lock_guard load_lock(load_mtx_);
+        lock.lock();
+        while (!current_.main->loaded(columns)) {
+            auto const main = current_.main;
+            auto const inserted = inserted_;
+            auto const filename = filename_;
+            auto const file = file_;
+            lock.unlock();
+            indices_t missing;
+            for (auto const c : columns)
+                if (!main->loaded(c))
+                    missing.push_back(c);
+            auto loaded = read_table(filename, RowRange(0, std::numeric_limits<index_t>::max() - 1), missing);
+            // checked after reading, the file can change while it's read
+            if (FileIdentity::of(filename) != file) {
+                reload(filename);
+                table_check(false, "table file has changed since it was loaded, reloading it");
+            }
+            table_check(loaded.rows_count() + (inserted ? isize(inserted->positions) : 0) == main->rows_count(),
+                    "table file has changed since it was read");
+            if (inserted)
+                loaded = with_inserted_(loaded, *inserted, missing);
+            log_info("loaded", isize(missing), "columns of", filename);
+            lock.lock();
+            // a reload has swapped the table in the meantime
+            if (current_.main != main)
+                continue;
+            current_.main = std::make_shared<const Table>(evict_(main->with_columns(loaded), columns));
+            column_loads_ += isize(missing);
+        }
+        return current_;
+    }
+    Metadata const& metadata() const noexcept { return md_; }
+    // rows have to be sorted by key
+    void insert(Table rows) {
+        table_check(rows.metadata() == metadata(), "inserted rows don't match table columns");
+        std::lock_guard lock(mtx_);
+        pending_.push_back(move(rows));
+    }
+    // Merges deltas existing at the time of call into the main table. Queries keep using the previous
+    // snapshot until the new main table is ready.
+    void merge() {
+        std::lock_guard merge_lock(merge_mtx_);
+        freeze_();
+        Snapshot snap;
+        std::shared_ptr<const Inserted> inserted;
+        string filename;
+        {
+            std::lock_guard freeze_lock(freeze_mtx_);
+            std::lock_guard lock(mtx_);
+            frozen_ = isize(current_.deltas);
+            snap = current_;
+            inserted = inserted_;
+            filename = filename_;
+        }
+        if (snap.deltas.empty())
+            return;
+        auto delta = snap.deltas.front();
+        for (auto const i : IntRange(1, isize(snap.deltas)))
+            delta = std::make_shared<const Table>(delta->merged(*snap.deltas[i]));
+        std::optional<Table> tbl;
+        try {
+            // out-of-core tables stay out of core, columns of lazy tables which aren't loaded stay placeholders
+            tbl = options_.column_dir.empty() ? snap.main->merged(*delta)
+                : merge_to_files(*snap.main, *delta, options_.column_dir, table_name(filename));
+        } catch (data_error const&) {
+            // queries keep using the main table and the deltas, the next merge tries again
+            std::lock_guard lock(mtx_);
+            frozen_ = 0;
+            ++failed_merges_;
+            throw;
+        }
+        if (options_.lazy_columns)
+            inserted = merged_inserted_(*snap.main, inserted.get(), *delta);
+        build_indexes_(*tbl);
+        log_info("merged", delta->rows_count(), "rows into the main table");
+        std::lock_guard lock(mtx_);
+        current_.main = std::make_shared<const Table>(move(*tbl));
+        inserted_ = move(inserted);
+        ++merges_;
+        current_.deltas.erase(current_.deltas.begin(), current_.deltas.begin() + frozen_);
+        frozen_ = 0;
+        ++current_.version;
+    }
+    // Reads the table from the file in a background thread and swaps it in once it's valid, dropping
+    // inserted rows. Queries keep using the previous snapshot in the meantime. Returns false if
+    // another reload is still running.
+    bool reload(string filename) {
+        std::lock_guard lock(reload_mtx_);
+        if (reload_.valid() && reload_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return false;
+        reload_ = std::async(std::launch::async, [this, filename = move(filename)] { reload_now_(filename); });
+        return true;
+    }
+    // Waits for the last reload and rethrows its error. Returns false if there was no reload since
+    // the previous call.
+    bool wait_reload() {
+        std::future<void> res;
+        {
+            std::lock_guard lock(reload_mtx_);
+            res = move(reload_);
+        }
+        if (!res.valid())
+            return false;
+        res.get();
+        return true;
+    }
+    i64 merges() const noexcept { return merges_; }
+    i64 failed_merges() const noexcept { return failed_merges_; }
+    i64 reloads() const noexcept { return reloads_; }
+    i64 failed_reloads() const noexcept { return failed_reloads_; }
+    bool lazy() const noexcept { return options_.lazy_columns; }
+    // of lazily loaded columns
+    i64 column_loads() const noexcept { return column_loads_; }
+    i64 column_evictions() const noexcept { return column_evictions_; }
+private:
+    // Turns rows inserted since the last snapshot into a delta. It's combined with the newest deltas
+    // while they aren't much bigger, so there are O(log n) deltas and an inserted row is copied O(log n)
+    // times. Tables are built outside of mtx_, queries only wait if they have to see the new rows.
+    void freeze_() {
+        {
+            std::lock_guard lock(mtx_);
+            if (pending_.empty() && !freezing_)
+                return;
+        }
+        std::lock_guard freeze_lock(freeze_mtx_);
+        vector<Table> pending;
+        vector<std::shared_ptr<const Table>> newest;
+        {
+            std::lock_guard lock(mtx_);
+            if (pending_.empty())
+                return;
+            pending.swap(pending_);
+            newest.assign(current_.deltas.begin() + frozen_, current_.deltas.end());
+            freezing_ = true;
+        }
+        auto delta = [&] {
+            if (isize(pending) == 1)
+                return std::make_shared<const Table>(move(pending.front()));
+            // from_rows() keeps the insertion order of rows with equal keys
+            vector<vi64> rows;
+            for (auto const& tbl : pending) {
+                for (auto const r : tbl.row_range()) {
+                    auto& row = rows.emplace_back();
+                    for (auto const c : tbl.columns())
+                        row.push_back(tbl.column(c)->at(r));
+                }
+            }
+            return std::make_shared<const Table>(Table::from_rows(md_, move(rows)));
+        }();
+        i64 combined = 0;
+        for (; combined < isize(newest) && newest.rbegin()[combined]->rows_count() <= 2 * delta->rows_count();
+                ++combined)
+            delta = std::make_shared<const Table>(newest.rbegin()[combined]->merged(*delta));
+        std::lock_guard lock(mtx_);
+        // merge() removes only older deltas, it can't take these ones while freeze_mtx_ is held
+        current_.deltas.resize(isize(current_.deltas) - combined);
+        current_.deltas.push_back(move(delta));
+        ++current_.version;
+        freezing_ = false;
+    }
+    // of every new main table
+    void build_indexes_(Table& tbl) const {
+        if (options_.row_store)
+            tbl.build_row_store();
+        indices_t aggregated;
+        for (auto const& name : options_.range_aggregates)
+            if (md_.has_column(name))
+                aggregated.push_back(md_.column_id(name));
+        if (!aggregated.empty())
+            tbl.build_aggregates(aggregated);
+        if (options_.key_filter)
+            tbl.build_key_filter();
+    }
+    // Rows of a lazily loaded main table which aren't in the file, with all columns, in the order of the
+    // main table. Positions are their row numbers in the main table.
+    struct Inserted {
+        Table rows;
+        indices_t positions;
+    };
+    // of the table merging the main table with the delta
+    static std::shared_ptr<const Inserted> merged_inserted_(Table const& main, Inserted const* inserted,
+            Table const& delta) {
+        indices_t positions;
+        index_t row = 0;
+        i64 next = 0;
+        for (auto const& [tbl, rows] : main.merge_runs(delta)) {
+            if (tbl == &delta) {
+                for (auto const r : rows)
+                    positions.push_back(row + r - rows.l());
+            } else if (inserted) {
+                for (; next < isize(inserted->positions) && inserted->positions[next] <= rows.r(); ++next)
+                    positions.push_back(row + inserted->positions[next] - rows.l());
+            }
+            row += rows.len();
+        }
+        // rows of the main table go first among equal keys, as in the merged table
+        auto merged = inserted ? inserted->rows.merged(delta) : delta;
+        return std::make_shared<const Inserted>(Inserted{move(merged), move(positions)});
+    }
+    // columns read from the file, with inserted rows put at their positions in the main table
+    static Table with_inserted_(Table const& from_file, Inserted const& inserted, indices_t const& columns) {
+        auto const& md = from_file.metadata();
+        vector<IntColumn::ptr> res(md.columns_count());
+        vector<bool> loaded(md.columns_count());
+        for (auto const c : md.columns()) {
+            res[c] = IntColumn::make();
+            res[c]->name() = md.column_name(c);
+        }
+        for (auto const c : columns) {
+            index_t file_row = 0, row = 0;
+            for (auto const i : IntRange(0, isize(inserted.positions))) {
+                auto const pos = inserted.positions[i];
+                res[c]->append(*from_file.column(c), RowRange(file_row, file_row + pos - row - 1));
+                file_row += pos - row;
+                res[c]->push_back(inserted.rows.column(c)->at(i));
+                row = pos + 1;
+            }
+            res[c]->append(*from_file.column(c), RowRange(file_row, from_file.rows_count() - 1));
+            loaded[c] = true;
+        }
+        return Table(md, move(res), move(loaded));
+    }
+    // drops the least recently used columns until the rest fits into the budget
+    Table evict_(Table tbl, indices_t const& needed) {
+        if (options_.memory_budget <= 0)
+            return tbl;
+        vector<std::pair<i64, index_t>> candidates;
+        i64 bytes = 0;
+        for (auto const c : IntRange(std::max<i64>(md_.key_len(), 1), md_.columns_count())) {
+            if (!tbl.loaded(c))
+                continue;
+            bytes += tbl.rows_count() * i64(sizeof(value_t));
+            if (!fun::contains(needed, c))
+                candidates.emplace_back(last_use_[c], c);
+        }
+        fun::sort(candidates);
+        indices_t evicted;
+        for (auto it = candidates.begin(); it != candidates.end() && bytes > options_.memory_budget; ++it) {
+            evicted.push_back(it->second);
+            bytes -= tbl.rows_count() * i64(sizeof(value_t));
+        }
+        if (evicted.empty())
+            return tbl;
+        column_evictions_ += isize(evicted);
+        return tbl.without_columns(evicted);
+    }
+    void reload_now_(string const& filename) {
+        try {
+            auto const file = FileIdentity::of(filename);
+            auto tbl = load_table(filename, options_);
+#ifndef NO_VALIDATION
+            TablePlayground(tbl).validate();
+#endif
+            table_check(tbl.metadata() == md_, "reloaded table has different columns");
+            build_indexes_(tbl);
+            // a merge running now would swap in the old rows again
+            std::lock_guard merge_lock(merge_mtx_);
+            std::lock_guard freeze_lock(freeze_mtx_);
+            std::lock_guard lock(mtx_);
+            pending_.clear();
+            inserted_.reset();
+            current_ = Snapshot{std::make_shared<const Table>(move(tbl)), {}, current_.version + 1};
+            filename_ = filename;
+            file_ = file;
+            ++reloads_;
+            log_info("reloaded table from", filename);
+        } catch (data_error const& e) {
+            ++failed_reloads_;
+            log_info("reload failed:", std::string(e.what()));
+            throw;
+        }
+    }
+    void merge_loop_() {
+        std::unique_lock lock(mtx_);
+        while (!cv_.wait_for(lock, options_.merge_interval, [this] { return stop_; })) {
+            lock.unlock();
+            try {
+                merge();
+            } catch (data_error const& e) {
+                log_info("merge failed:", std::string(e.what()));
+            }
+            lock.lock();
+        }
+    }
+    Metadata const md_;
+    StoreOptions const options_;
+    mutable std::mutex mtx_;
+    // the table was loaded from
+    string filename_;
+    FileIdentity file_;
+    // of columns, in use_clock_ ticks
+    vector<i64> last_use_;
+    i64 use_clock_ = 0;
+    std::mutex load_mtx_;
+    std::atomic<i64> column_loads_ = 0;
+    std::atomic<i64> column_evictions_ = 0;
+    std::mutex merge_mtx_;
+    Snapshot current_;
+    // of the main table of a lazy table, nullptr if all its rows are in the file
+    std::shared_ptr<const Inserted> inserted_;
+    // leading deltas being merged at the moment
+    i64 frozen_ = 0;
+    // inserted rows, not yet in a delta, see freeze_()
+    vector<Table> pending_;
+    bool freezing_ = false;
+    std::mutex freeze_mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread merger_;
+    std::mutex reload_mtx_;
+    std::future<void> reload_;
+    std::atomic<i64> merges_ = 0;
+    std::atomic<i64> failed_merges_ = 0;
+    std::atomic<i64> reloads_ = 0;
+    std::atomic<i64> failed_reloads_ = 0;
+};
+// Tables given on the command line, named after their files. The first one is the default table:
+// it's read by queries without "from", and it's the only one that can be modified.
+class Catalog {
+public:
+    void add(string name, std::unique_ptr<TableStore> store) {
+        massert2(!find_(name));
+        tables_.emplace_back(move(name), move(store));
+    }
+    TableStore& default_store() const { return *tables_.front().second; }
+    // the default table for an empty name
+    TableStore& find(string const& name) const {
+        if (name.empty())
+            return default_store();
+        auto const store = find_(name);
+        query_semantics_check(store, "unknown table name: " + name);
+        return *store;
+    }
+    bool is_default(FromClause const& from) const {
+        return from.joined.empty() && (from.table.empty() || from.table == tables_.front().first);
+    }
+private:
+    TableStore* find_(string const& name) const {
+        for (auto const& [n, store] : tables_)
+            if (n == name)
+                return store.get();
+        return nullptr;
+    }
+    vector<std::pair<string, std::unique_ptr<TableStore>>> tables_;
+};
+// }}}
+// join {{{
+// Two tables joined on their leading key columns.
+struct JoinQuery {
+    // predicates of each table, without selected columns
+    Query left, right;
+    // number of join columns
+    i64 key_len;
+    // output columns: (0 for the left table or 1 for the right one, column id)
+    vector<std::pair<i64, index_t>> select;
+    vstr header;
+};
+JoinQuery parse_join(Table const& left, Table const& right, QueryParser& parser) {
+    auto const& from = parser.from();
+    query_semantics_check(from.table != from.joined, "table can't be joined with itself: " + from.table);
+    std::array<Metadata const*, 2> const mds = {&left.metadata(), &right.metadata()};
+    std::array<string, 2> const names = {from.table, from.joined};
+    auto const key_len = isize(from.join_on);
+    for (auto const i : IntRange(0, key_len))
+        for (auto const md : mds)
+            query_semantics_check(i < md->key_len() && md->column_name(i) == from.join_on[i],
+                    "join columns have to be leading key columns of both tables: " + from.join_on[i]);
+    // join columns are in both tables, other columns can be prefixed with the table name
+    auto const resolve = [&](string const& name) {
+        vector<std::pair<i64, index_t>> res;
+        auto const dot = name.find('.');
+        if (dot != string::npos) {
+            auto const table = name.substr(0, dot);
+            query_semantics_check(fun::contains(names, table), "unknown table name: " + table);
+            auto const side = names[0] == table ? 0 : 1;
+            res.emplace_back(side, mds[side]->column_id(name.substr(dot + 1)));
+            return res;
+        }
+        for (auto const side : {0, 1})
+            if (mds[side]->has_column(name))
+                res.emplace_back(side, mds[side]->column_id(name));
+        query_semantics_check(!res.empty(), "unknown column name: " + name);
+        query_semantics_check(isize(res) == 1 || fun::contains(from.join_on, name), "ambiguous column name: " + name);
+        return res;
+    };
+    vector<std::pair<i64, index_t>> select;
+    vstr header;
+    for (auto const& token : parser.select()) {
+        if (token != "*") {
+            select.push_back(resolve(token).front());
+            header.push_back(token);
+            continue;
+        }
+        for (auto const side : {0, 1}) {
+            for (auto const id : mds[side]->columns()) {
+                auto const& name = mds[side]->column_name(id);
+                if (side == 1 && id < key_len)
+                    continue;
+                select.emplace_back(side, id);
+                header.push_back(id >= key_len && mds[1 - side]->has_column(name) ? names[side] + "." + name : name);
+            }
+        }
+    }
+    std::array<TablePredicateBuilder, 2> where_builders = {TablePredicateBuilder(*mds[0]), TablePredicateBuilder(*mds[1])};
+    parser.parse_where([&](auto const& col, auto const& sep, auto const& val) {
+        for (auto const& [side, id] : resolve(col))
+            where_builders[side].add_pred(mds[side]->column_name(id), sep, val);
+    });
+    return JoinQuery{Query{where_builders[0].build(left), {}}, Query{where_builders[1].build(right), {}},
+        key_len, move(select), move(header)};
+}
+// Rows of both sides come in key order, so rows with equal join columns form a group on each side. The
+// left side is streamed, the right one is walked along, galloping over rows without a match.
+// Returns the number of written rows.
+i64 merge_join(JoinQuery const& q, Snapshot const& left, vector<vector<RowNumbers>> const& left_rows,
+        Snapshot const& right, vector<vector<RowNumbers>> const& right_rows, OutputFrame& frame) {
+    frame.add_header(q.header);
+    vector<std::pair<Table const*, index_t>> rrows;
+    right.foreach_row(right_rows, [&](Table const& tbl, index_t r) { rrows.emplace_back(&tbl, r); });
+    auto const rend = rrows.end();
+    auto rit = rrows.begin();
+    i64 written = 0;
+    left.foreach_row(left_rows, [&](Table const& ltbl, index_t lr) {
+        auto const less = [&](auto const& rrow) { return rrow.first->compare_key(rrow.second, ltbl, lr, q.key_len) < 0; };
+        i64 step = 1;
+        for (; rit != rend && less(*rit); step *= 2) {
+            auto const next = rend - rit > step ? rit + step : rend;
+            rit = std::partition_point(rit, next, less);
+        }
+        std::array<std::pair<Table const*, index_t>, 2> row = {std::make_pair(&ltbl, lr)};
+        for (auto it = rit; it != rend && it->first->compare_key(it->second, ltbl, lr, q.key_len) == 0; ++it) {
+            row[1] = *it;
+            for (auto const i : IntRange(0, isize(q.select))) {
+                auto const& [side, id] = q.select[i];
+                auto const value = row[side].first->column(id)->at(row[side].second);
+                if (i == 0)
+                    frame.new_row(value);
+                else
+                    frame.add_to_row(value);
+            }
+            ++written;
+        }
+    });
+    return written;
+}
+// }}}
+// grouping {{{
+// Grouping by leading key columns: the rows come sorted by them, so groups are consecutive and found
+// by galloping over the rows instead of hashing.
+struct GroupQuery {
+    enum class Fn { value, count, sum, min, max };
+    // output column: the value of a group column, or an aggregate of the column (none for count)
+    struct Output {
+        Fn fn;
+        index_t column;
+    };
+    // predicates, and selects all columns read by outputs
+    Query query;
+    // groups have equal values of this many leading key columns
+    i64 prefix_len;
+    vector<Output> outputs;
+    vstr header;
+    GroupQuery bind(Table const& tbl) const { return GroupQuery{query.bind(tbl), prefix_len, outputs, header}; }
+};
+// "select distinct" of leading key columns, or "select" of group columns and count(*), sum(col),
+// min(col), max(col) with "group by" leading key columns
+GroupQuery parse_group(Table const& tbl, QueryParser& parser) {
+    using Fn = GroupQuery::Fn;
+    auto const& md = tbl.metadata();
+    vector<GroupQuery::Output> outputs;
+    columns_t read;
+    for (auto const& token : parser.select()) {
+        auto const open = token.find('(');
+        if (open == string::npos) {
+            query_semantics_check(token != "*", "select * can't be grouped");
+            outputs.push_back({Fn::value, md.column_id(token)});
+            continue;
+        }
+        query_format_check(token.back() == ')', "no ')' after aggregate: " + token);
+        auto const fn_name = token.substr(0, open);
+        auto const arg = token.substr(open + 1, isize(token) - open - 2);
+        query_semantics_check(!parser.distinct(), "distinct can't have aggregates: " + token);
+        if (fn_name == "count") {
+            query_semantics_check(arg == "*", "only count(*) is supported: " + token);
+            outputs.push_back({Fn::count, -1});
+            continue;
+        }
+        auto const fn = fn_name == "sum" ? Fn::sum : fn_name == "min" ? Fn::min : fn_name == "max" ? Fn::max
+            : throw query_semantics_error("unknown aggregate: " + fn_name);
+        outputs.push_back({fn, md.column_id(arg)});
+    }
+    TablePredicateBuilder where_builder(md);
+    parser.parse_where([&](auto const& col, auto const& sep, auto const& val) { where_builder.add_pred(col, sep, val); });
+    cnames group_by = parser.group_by();
+    if (parser.distinct())
+        for (auto const& output : outputs)
+            group_by.push_back(md.column_name(output.column));
+    indices_t group_ids;
+    for (auto const& name : group_by) {
+        auto const id = md.column_id(name);
+        query_semantics_check(!fun::contains(group_ids, id), "column grouped twice: " + name);
+        group_ids.push_back(id);
+    }
+    for (auto const& name : group_by)
+        query_semantics_check(md.column_id(name) < std::min(md.key_len(), isize(group_by)),
+                "group by columns have to be leading key columns: " + name);
+    for (auto const& output : outputs) {
+        if (output.fn == Fn::value)
+            query_semantics_check(fun::contains(group_ids, output.column),
+                    "column has to be grouped or aggregated: " + md.column_name(output.column));
+        if (output.fn != Fn::count)
+            read.emplace_back(tbl, output.column);
+    }
+    return GroupQuery{Query{where_builder.build(tbl), move(read)}, isize(group_by), move(outputs), parser.select()};
+}
+// Aggregates of the current group, fed with runs of rows sorted by key.
+class GroupAccumulator {
+public:
+    GroupAccumulator(GroupQuery const& q) : q_(q), values_(q.outputs.size()) {}
+    bool empty() const noexcept { return count_ == 0; }
+    // whether the row belongs to the current group
+    bool same_group(Table const& tbl, index_t row) const {
+        return tbl.compare_key(row, *first_table_, first_row_, q_.prefix_len) == 0;
+    }
+    // rows at positions [begin, end) of rows of the table
+    void add(Table const& tbl, RowNumbers const& rows, i64 begin, i64 end) {
+        massert2(begin < end);
+        if (empty()) {
+            first_table_ = &tbl;
+            first_row_ = rows.at(begin);
+            for (auto const i : IntRange(0, isize(q_.outputs)))
+                values_[i] = q_.outputs[i].fn == GroupQuery::Fn::min ? std::numeric_limits<value_t>::max()
+                    : q_.outputs[i].fn == GroupQuery::Fn::max ? std::numeric_limits<value_t>::min() : 0;
+        }
+        for (auto const i : IntRange(0, isize(q_.outputs))) {
+            auto const& output = q_.outputs[i];
+            if (output.fn == GroupQuery::Fn::value || output.fn == GroupQuery::Fn::count)
+                continue;
+            auto const& col = *tbl.column(output.column);
+            if (auto const aggregates = rows.is_range() ? tbl.aggregates(output.column) : nullptr) {
+                RowRange const range(rows.at(begin), rows.at(end - 1));
+                add_(i, output.fn == GroupQuery::Fn::sum ? aggregates->sum(range)
+                    : output.fn == GroupQuery::Fn::min ? aggregates->min(range) : aggregates->max(range));
+                continue;
+            }
+            // within a group, the key column after the group columns is sorted
+            if (output.fn != GroupQuery::Fn::sum && output.column == q_.prefix_len && output.column < tbl.metadata().key_len()) {
+                add_(i, col.at(rows.at(begin)));
+                add_(i, col.at(rows.at(end - 1)));
+                continue;
+            }
+            for (auto const pos : IntRange(begin, end))
+                add_(i, col.at(rows.at(pos)));
+        }
+        count_ += end - begin;
+    }
+    void write(OutputFrame& frame) {
+        for (auto const i : IntRange(0, isize(q_.outputs))) {
+            auto const& output = q_.outputs[i];
+            auto const value = output.fn == GroupQuery::Fn::value ? first_table_->column(output.column)->at(first_row_)
+                : output.fn == GroupQuery::Fn::count ? count_ : values_[i];
+            if (i == 0)
+                frame.new_row(value);
+            else
+                frame.add_to_row(value);
+        }
+        count_ = 0;
+    }
+private:
+    void add_(i64 i, value_t value) {
+        auto& acc = values_[i];
+        switch (q_.outputs[i].fn) {
+        case GroupQuery::Fn::sum:
+            // wraps around on overflow
+            acc = value_t(uint64_t(acc) + uint64_t(value));
+            break;
+        case GroupQuery::Fn::min:
+            acc = std::min(acc, value);
+            break;
+        case GroupQuery::Fn::max:
+            acc = std::max(acc, value);
+            break;
+        default:
+            break;
+        }
+    }
+    GroupQuery const& q_;
+    vector<value_t> values_;
+    i64 count_ = 0;
+    // of the current group
+    Table const* first_table_ = nullptr;
+    index_t first_row_ = 0;
+};
+// Writes a row for every group of the rows, returns the number of groups. The end of a group is found
+// by galloping over the sorted rows of the main table, so a group costs O(log of its size) comparisons,
+// plus reading the aggregated values. Delta rows are few, they're sorted and added one by one between
+// the runs of the main table.
+i64 write_groups(GroupQuery const& q, Snapshot const& snap, vector<vector<RowNumbers>> const& rows,
+        OutputFrame& frame) {
+    frame.add_header(q.header);
+    GroupAccumulator acc(q);
+    i64 groups = 0;
+    auto const add = [&](Table const& tbl, RowNumbers const& r, i64 begin, i64 end) {
+        if (!acc.empty() && !acc.same_group(tbl, r.at(begin))) {
+            acc.write(frame);
+            ++groups;
+        }
+        acc.add(tbl, r, begin, end);
+    };
+    auto const& tbl = *snap.main;
+    auto const delta_rows = snap.sorted_delta_rows(rows);
+    auto next = delta_rows.begin();
+    // delta rows with group keys less than the main table row's, or equal ones too
+    auto const add_delta_rows = [&](index_t row, bool equal) {
+        for (; next != delta_rows.end(); ++next) {
+            auto const cmp = next->first->compare_key(next->second, tbl, row, q.prefix_len);
+            if (cmp > 0 || (cmp == 0 && !equal))
+                break;
+            add(*next->first, RowNumbers(RowRange(next->second, next->second)), 0, 1);
+        }
+    };
+    for (auto const& r : rows.front()) {
+        for (i64 pos = 0; pos < r.count();) {
+            auto const row = r.at(pos);
+            auto const same = [&](i64 p) { return tbl.compare_key(r.at(p), tbl, row, q.prefix_len) == 0; };
+            // same(lo) holds, and doesn't at hi
+            i64 lo = pos, step = 1;
+            for (; lo + step < r.count() && same(lo + step); step *= 2)
+                lo += step;
+            auto hi = std::min(lo + step, r.count());
+            while (hi - lo > 1) {
+                auto const mid = lo + (hi - lo) / 2;
+                (same(mid) ? lo : hi) = mid;
+            }
+            // the order of rows within a group doesn't change its aggregates
+            add_delta_rows(row, false);
+            add(tbl, r, pos, hi);
+            add_delta_rows(row, true);
+            pos = hi;
+        }
+    }
+    for (; next != delta_rows.end(); ++next)
+        add(*next->first, RowNumbers(RowRange(next->second, next->second)), 0, 1);
+    if (!acc.empty()) {
+        acc.write(frame);
+        ++groups;
+    }
+    return groups;
+}
+// }}}
+// query cache {{{
+struct CachedResult {
+    // results in each segment of the snapshot
+    vector<vector<RowNumbers>> rows;
+    // formatted output, kept only for small results
+    std::optional<string> output;
+    i64 size_in_bytes() const noexcept {
+        i64 res = sizeof(*this) + (output ? isize(*output) : 0);
+        for (auto const& segment_rows : rows)
+            for (auto const& r : segment_rows)
+                res += r.size_in_bytes();
+        return res;
+    }
+};
+// LRU cache of query results, keyed by Query::normalized(). Tables are immutable, so entries only
+// have to be dropped when the snapshot changes.
+class QueryCache {
+public:
+    using entry_ptr = std::shared_ptr<const CachedResult>;
+    // results with at most that many values have their formatted output cached as well
+    static constexpr i64 output_values_limit = 4096;
+    QueryCache(i64 bytes_limit) : bytes_limit_(bytes_limit) {}
+    bool enabled() const noexcept { return bytes_limit_ > 0; }
+    entry_ptr find(string const& key) {
+        if (!enabled())
+            return nullptr;
+        auto const it = index_.find(key);
+        if (it == index_.end()) {
+            ++misses_;
+            return nullptr;
+        }
+        ++hits_;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return it->second->second;
+    }
+    void insert(string const& key, entry_ptr result) {
+        auto const bytes = entry_size_(key, *result);
+        if (!enabled() || bytes > bytes_limit_ || index_.count(key))
+            return;
+        while (bytes_ + bytes > bytes_limit_) {
+            auto const& [last_key, last_result] = entries_.back();
+            bytes_ -= entry_size_(last_key, *last_result);
+            index_.erase(last_key);
+            entries_.pop_back();
+            ++evictions_;
+        }
+        entries_.emplace_front(key, move(result));
+        index_[key] = entries_.begin();
+        bytes_ += bytes;
+    }
+    void clear() noexcept {
+        entries_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+    string _str() const {
+        return "hits=" + str(hits_) + " misses=" + str(misses_) + " evictions=" + str(evictions_) +
+            " entries=" + str(isize(entries_)) + " bytes=" + str(bytes_) + " bytes_limit=" + str(bytes_limit_);
+    }
+private:
+    static i64 entry_size_(string const& key, CachedResult const& result) noexcept
+        { return 2 * isize(key) + result.size_in_bytes(); }
+    using entries_t = std::list<std::pair<string, entry_ptr>>;
+    i64 bytes_limit_;
+    i64 bytes_ = 0, hits_ = 0, misses_ = 0, evictions_ = 0;
+    entries_t entries_;
+    std::unordered_map<string, entries_t::iterator> index_;
+};
+// }}}
+// metrics {{{
+// Allocations of the calling thread, counted by operator new. Only the owning thread writes it, so counting
+// is a plain load and store rather than a locked increment.
+thread_local std::atomic<i64> thread_allocations{0};
+// Links the counter of a thread into the list summed by "stats". Constructed on the first allocation of
+// the thread; on exit, the thread's count is folded into the total of exited threads.
+class AllocationCounter {
+public:
+    AllocationCounter() noexcept {
+        std::lock_guard lock(mutex_);
+        next_ = head_;
+        if (head_)
+            head_->prev_ = this;
+        head_ = this;
+    }
+    AllocationCounter(AllocationCounter const&) = delete;
+    AllocationCounter& operator=(AllocationCounter const&) = delete;
+    ~AllocationCounter() {
+        std::lock_guard lock(mutex_);
+        exited_ += thread_allocations.load(std::memory_order_relaxed);
+        (prev_ ? prev_->next_ : head_) = next_;
+        if (next_)
+            next_->prev_ = prev_;
+    }
+    static i64 total() {
+        std::lock_guard lock(mutex_);
+        auto res = exited_;
+        for (auto c = head_; c; c = c->next_)
+            res += c->count_->load(std::memory_order_relaxed);
+        return res;
+    }
+private:
+    std::atomic<i64> const* count_ = &thread_allocations;
+    AllocationCounter* prev_ = nullptr;
+    AllocationCounter* next_ = nullptr;
+    inline static std::mutex mutex_;
+    inline static AllocationCounter* head_ = nullptr;
+    inline static i64 exited_ = 0;
+};
+thread_local AllocationCounter allocation_counter;
+inline void count_allocation() noexcept {
+    [[maybe_unused]] auto const& registered = allocation_counter;
+    thread_allocations.store(thread_allocations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+// Stream buffer in front of another one, counting bytes passed through. sync() only hands the bytes over,
+// so the target keeps its own buffering.
+class CountingStreambuf : public std::streambuf {
+public:
+    CountingStreambuf(std::streambuf* target) : target_(target), buffer_(1 << 16) { reset_(); }
+    ~CountingStreambuf() override {
+        flush_();
+        target_->pubsync();
+    }
+    i64 bytes() const noexcept { return bytes_ + (pptr() - pbase()); }
+protected:
+    int_type overflow(int_type ch) override {
+        if (flush_() != 0)
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            sputc(traits_type::to_char_type(ch));
+        return traits_type::not_eof(ch);
+    }
+    int sync() override { return flush_(); }
+private:
+    int flush_() {
+        auto const n = pptr() - pbase();
+        if (target_->sputn(pbase(), n) != n)
+            return -1;
+        bytes_ += n;
+        reset_();
+        return 0;
+    }
+    void reset_() { setp(buffer_.data(), buffer_.data() + buffer_.size()); }
+    std::streambuf* target_;
+    vector<char> buffer_;
+    i64 bytes_ = 0;
+};
+// Bounded single-producer single-consumer queue on a ring of slots, without locks: only the producer
+// moves tail_ and only the consumer moves head_. Waiting for a free slot or an item spins, then
+// backs off to short sleeps.
+template <class T>
+class SpscQueue {
+public:
+    SpscQueue(i64 capacity) : slots_(capacity + 1) {}
+    // the item is left untouched if the queue is full
+    bool try_push(T& item) {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        auto const next = (tail + 1) % isize(slots_);
+        if (next == head_.load(std::memory_order_acquire))
+            return false;
+        slots_[tail] = move(item);
+        tail_.store(next, std::memory_order_release);
+        wake_();
+        return true;
+    }
+    void push(T item) {
+        while (!try_push(item))
+            wait_([&] { return !full_(); });
+    }
+    std::optional<T> try_pop() {
+        auto const head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return std::nullopt;
+        std::optional<T> res(move(slots_[head]));
+        head_.store((head + 1) % isize(slots_), std::memory_order_release);
+        wake_();
+        return res;
+    }
+    T pop() {
+        for (;;) {
+            if (auto item = try_pop())
+                return move(*item);
+            wait_([&] { return !empty(); });
+        }
+    }
+    bool empty() const noexcept
+        { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+private:
+    bool full_() const noexcept {
+        return (tail_.load(std::memory_order_acquire) + 1) % isize(slots_) == head_.load(std::memory_order_acquire);
+    }
+    // Spins for a while, then sleeps until the other side moves. The waiter announces itself before
+    // checking again, and the other side checks for waiters after moving, so one of them sees the other.
+    template <class Ready>
+    void wait_(Ready const& ready) {
+        for (i64 spins = 0; spins < 64; ++spins) {
+            if (ready())
+                return;
+            std::this_thread::yield();
+        }
+        std::unique_lock lock(mtx_);
+        waiters_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv_.wait(lock, ready);
+        waiters_.fetch_sub(1);
+    }
+    void wake_() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed) == 0)
+            return;
+        // the waiter holds the mutex from its last check until it sleeps
+        { std::lock_guard lock(mtx_); }
+        cv_.notify_all();
+    }
+    vector<T> slots_;
+    alignas(64) std::atomic<i64> head_ = 0;
+    alignas(64) std::atomic<i64> tail_ = 0;
+    std::atomic<i64> waiters_ = 0;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
+// Stream buffer handing its contents over to a writer thread, which writes them to the target, so
+// that the query thread doesn't wait for the reader of the output. Buffers are recycled: one is filled
+// while the others are being written, and with all of them in flight the producer waits, so a slow
+// reader holds queries back instead of growing memory. sync() only hands the buffer over. Formatting
+// of results can be moved to the writer thread as well, see defer().
+class OutputPipeline : public std::streambuf {
+public:
+    using Task = std::function<void(std::ostream&)>;
+    OutputPipeline(std::streambuf* target, i64 buffers_count = 4, i64 buffer_size = 1 << 16)
+            : target_(target), queue_(2 * buffers_count), free_(buffers_count), current_(buffer_size) {
+        for (auto const i : IntRange(1, buffers_count)) {
+            (void)i;
+            free_.push(vector<char>(buffer_size));
+        }
+        reset_();
+        writer_ = std::thread([this] { write_loop_(); });
+    }
+    OutputPipeline(OutputPipeline const&) = delete;
+    OutputPipeline& operator=(OutputPipeline const&) = delete;
+    ~OutputPipeline() override {
+        hand_over_();
+        queue_.push(Item{{}, 0, {}, true});
+        writer_.join();
+    }
+    // Calls task with a stream to the target in the writer thread, after everything written before.
+    // The task has to own whatever it reads.
+    void defer(Task task) {
+        hand_over_();
+        queue_.push(Item{{}, 0, move(task), false});
+        ++pushed_;
+    }
+    // waits until the writer has caught up with everything written before
+    void drain() {
+        hand_over_();
+        std::unique_lock lock(drain_mtx_);
+        drained_.wait(lock, [this] { return done_ == pushed_; });
+    }
+    // written by deferred tasks
+    i64 deferred_bytes() const noexcept { return deferred_bytes_; }
+protected:
+    int_type overflow(int_type ch) override {
+        hand_over_();
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            sputc(traits_type::to_char_type(ch));
+        return failed_ ? traits_type::eof() : traits_type::not_eof(ch);
+    }
+    int sync() override {
+        hand_over_();
+        return failed_ ? -1 : 0;
+    }
+private:
+    struct Item {
+        vector<char> buffer;
+        i64 size;
+        Task task;
+        bool stop;
+    };
+    void hand_over_() {
+        auto const n = pptr() - pbase();
+        if (n == 0)
+            return;
+        queue_.push(Item{move(current_), n, {}, false});
+        ++pushed_;
+        current_ = free_.pop();
+        reset_();
+    }
+    void reset_() { setp(current_.data(), current_.data() + current_.size()); }
+    void write_loop_() {
+        CountingStreambuf counting(target_);
+        std::ostream os(&counting);
+        for (auto item = queue_.pop(); !item.stop; item = queue_.pop()) {
+            if (item.task) {
+                // the query thread has moved on, so a failure is reported in place of the result
+                try {
+                    item.task(os);
+                } catch (std::exception const& e) {
+                    os << "\nquery error: " << e.what() << '\n';
+                } catch (...) {
+                    os << "\nquery error: unknown error while writing the result\n";
+                }
+                os.flush();
+                deferred_bytes_ = counting.bytes();
+            } else {
+                if (target_->sputn(item.buffer.data(), item.size) != item.size)
+                    failed_ = true;
+                free_.push(move(item.buffer));
+            }
+            if (queue_.empty())
+                target_->pubsync();
+            if (++done_ == pushed_) {
+                std::lock_guard lock(drain_mtx_);
+                drained_.notify_all();
+            }
+        }
+    }
+    std::streambuf* target_;
+    // writer's end
+    SpscQueue<Item> queue_;
+    // back to the producer
+    SpscQueue<vector<char>> free_;
+    vector<char> current_;
+    std::atomic<i64> deferred_bytes_ = 0;
+    std::atomic<bool> failed_ = false;
+    // items queued by the producer and processed by the writer
+    std::atomic<i64> pushed_ = 0;
+    std::atomic<i64> done_ = 0;
+    std::mutex drain_mtx_;
+    std::condition_variable drained_;
+    std::thread writer_;
+};
+// Cumulative metrics of the process, printed by the "stats" command.
+class Metrics {
+public:
+    Metrics(CountingStreambuf const& out, OutputPipeline const* pipeline = nullptr)
+        : out_(out), pipeline_(pipeline), start_(std::chrono::steady_clock::now()) {}
+    void record(string const& shape, QueryStages const& stages, i64 queries_count) {
+        queries_ += queries_count;
+        stages_ += stages;
+        i64 latency = 0;
+        for (auto const stage : stages.all())
+            latency += stage->nanoseconds;
+        latency_[shape].record(latency);
+    }
+    void record_error() noexcept { ++errors_; }
+    vstr lines() const {
+        auto const uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        vstr res = {"uptime_s=" + str(uptime) + " queries=" + str(queries_) + " errors=" + str(errors_)
+            + " queries_per_s=" + str(queries_ / std::max(uptime, 1e-9))
+            + " rows_scanned=" + str(stages_.full_scan.rows_in) + " rows_returned=" + str(stages_.write.rows_out)
+            + " bytes_written=" + str(out_.bytes() + (pipeline_ ? pipeline_->deferred_bytes() : 0))
+            + " allocations=" + str(AllocationCounter::total())};
+        for (auto const stage : stages_.all())
+            res.push_back("stage " + str(*stage));
+        for (auto const& [shape, histogram] : latency_)
+            res.push_back("latency shape=" + fun::surround(shape, '"') + " " + str(histogram));
+        return res;
+    }
+private:
+    CountingStreambuf const& out_;
+    OutputPipeline const* pipeline_;
+    std::chrono::steady_clock::time_point start_;
+    i64 queries_ = 0, errors_ = 0;
+    QueryStages stages_;
+    std::map<string, LatencyHistogram> latency_;
+};
+// }}}
+// main loop {{{
+constexpr char const* batch_begin = "batch";
+constexpr char const* batch_end = "end";
+constexpr char const* cache_command = "cache";
+constexpr char const* stats_command = "stats";
+constexpr char const* explain_prefix = "explain analyze ";
+constexpr char const* insert_command = "insert";
+constexpr char const* append_command = "append";
+constexpr char const* merge_command = "merge";
+constexpr char const* reload_command = "reload";
+constexpr char const* reload_wait_command = "reload wait";
+constexpr char const* batch_shape = "batch";
+constexpr char const* join_shape = "join";
+constexpr char const* group_shape = "group";
+// Arguments of a line starting with the command word, which may stand alone; nothing for other lines.
+std::optional<string> command_args(string const& line, string_view command) {
+    if (line.rfind(command, 0) != 0)
+        return std::nullopt;
+    if (line.size() == command.size())
+        return string();
+    if (line[command.size()] != ' ')
+        return std::nullopt;
+    return line.substr(command.size() + 1);
+}
+class Session {
+public:
+    // with the pipeline, uncached results are formatted in its writer thread
+    Session(Catalog const& catalog, i64 cache_bytes, CountingStreambuf const& out, bool hw_counters,
+            OutputFrame::Format format = OutputFrame::Format::text, OutputPipeline* pipeline = nullptr)
+        : catalog_(catalog), store_(catalog.default_store()), cache_(cache_bytes), metrics_(out, pipeline),
+          hw_(hw_counters ? std::make_unique<HwCounters>() : nullptr), format_(format), pipeline_(pipeline) {}
+    void run_query(string const& line) {
+        try {
+            QueryStages stages(hw());
+            auto parser = [&] {
+                auto const m = stages.measure(stages.parse);
+                return QueryParser(line);
+            }();
+            if (!parser.from().joined.empty()) {
+                query_semantics_check(!parser.grouped(), "group by and distinct aren't supported in joins");
+                run_join_(parser, stages);
+                return;
+            }
+            if (parser.grouped()) {
+                run_group_(parser, stages);
+                return;
+            }
+            auto const [snap, q] = parse_(catalog_.find(parser.from().table), parser, stages);
+            Measure mes(str(++count_));
+            log_info("query:", line);
+            dprintln(repr(q));
+            println("query number:", count_);
+            auto const key = cache_key_(q, parser.from());
+            if (auto const cached = cache_.find(key))
+                print_(snap, q, cached, stages);
+            else
+                print_fresh_(snap, q, key, select_rows_(snap, q, stages), stages);
+            metrics_.record(q.shape(), stages, 1);
+            dprintln();
+        } catch (const data_error& e) {
+            dprintln();
+            metrics_.record_error();
+            println("query error:", std::string(e.what()));
+        }
+    }
+    // Queries between "batch" and "end" lines are executed together, results are printed in input order.
+    void run_batch(std::istream& is) {
+        auto snap = snapshot_(store_);
+        QueryStages stages(hw());
+        vector<Query> queries;
+        vector<std::pair<i64, string>> errors;
+        string line;
+        while (std::getline(is, line) && line != batch_end) {
+            try {
+                auto const m = stages.measure(stages.parse);
+                QueryParser parser(line);
+                query_semantics_check(catalog_.is_default(parser.from()), "batch can only query the default table");
+                queries.push_back(parse(*snap.main, parser));
+            } catch (const data_error& e) {
+                errors.emplace_back(isize(queries), e.what());
+                metrics_.record_error();
+            }
+        }
+        indices_t columns;
+        for (auto const& q : queries)
+            for (auto const c : q.columns())
+                columns.push_back(c);
+        if (!snap.main->loaded(columns)) {
+            snap = snapshot_(store_, columns);
+            queries = fun::map(queries, [&snap](auto const& q) { return q.bind(*snap.main); });
+        }
+        auto const keys = fun::map(queries, [this](auto const& q) { return cache_key_(q, FromClause()); });
+        auto const cached = fun::map(keys, [this](auto const& key) { return cache_.find(key); });
+        vector<Query> to_select;
+        for (auto const i : IntRange(0, isize(queries)))
+            if (!cached[i])
+                to_select.push_back(queries[i]);
+        vector<vector<vector<RowNumbers>>> results(to_select.size());
+        {
+            Measure mes("batch of " + str(isize(queries)));
+            for (auto const segment : snap.segments()) {
+                auto const bound = segment == snap.main.get() ? to_select
+                    : fun::map(to_select, [segment](auto const& q) { return q.bind(*segment); });
+                auto segment_results = TablePlayground(*segment).select_rows(bound, stages);
+                for (auto const i : IntRange(0, isize(to_select)))
+                    results[i].push_back(move(segment_results[i]));
+            }
+        }
+        auto error_it = errors.begin();
+        auto result_it = results.begin();
+        for (auto const i : IntRange(0, isize(queries) + 1)) {
+            for (; error_it != errors.end() && error_it->first == i; ++error_it)
+                println("query error:", error_it->second);
+            if (i == isize(queries))
+                break;
+            println("query number:", ++count_);
+            if (cached[i])
+                print_(snap, queries[i], cached[i], stages);
+            else
+                print_fresh_(snap, queries[i], keys[i], move(*result_it++), stages);
+        }
+        metrics_.record(batch_shape, stages, isize(queries));
+    }
+    // Executes the query stage by stage, bypassing the cache, and prints a profile instead of the result.
+    void explain(string const& line) {
+        try {
+            QueryStages stages(hw());
+            auto parser = [&] {
+                auto const m = stages.measure(stages.parse);
+                return QueryParser(line);
+            }();
+            query_semantics_check(parser.from().joined.empty(), "explain analyze of a join isn't supported");
+            auto& store = catalog_.find(parser.from().table);
+            vector<FullscanRequest> fullscan_requests;
+            std::ostringstream os;
+            if (parser.grouped()) {
+                auto const [snap, q] = parse_group_(store, parser, stages);
+                auto const rows = select_rows_(snap, q.query, stages, &fullscan_requests);
+                auto const m = stages.measure(stages.write);
+                OutputFrame outp(os, format_);
+                stages.write.rows_in = stages.full_scan.rows_out;
+                stages.write.rows_out = write_groups(q, snap, rows, outp);
+            } else {
+                auto const [snap, q] = parse_(store, parser, stages);
+                auto const rows = select_rows_(snap, q, stages, &fullscan_requests);
+                {
+                    auto const m = stages.measure(stages.write);
+                    OutputFrame outp(os, format_);
+                    snap.write(q.select_cols, rows, outp);
+                }
+                stages.write.rows_in = stages.write.rows_out = stages.full_scan.rows_out;
+            }
+            println("explain: fullscan requests:", fullscan_requests);
+            for (auto const stage : stages.all())
+                println("explain: stage", *stage);
+            println("explain: output bytes:", isize(os.str()));
+        } catch (const data_error& e) {
+            println("query error:", std::string(e.what()));
+        }
+    }
+    // "insert v1 v2 ..." with a value for every column
+    void insert(string const& values) {
+        try {
+            std::stringstream ss(values);
+            vi64 row;
+            string token;
+            while (ss >> token) {
+                auto const [value, is_ok] = to_i64(token);
+                query_format_check(is_ok, "Error during converting to integer:", token);
+                row.push_back(value);
+            }
+            query_format_check(!row.empty(), "insert needs values");
+            store_.insert(Table::from_rows(store_.metadata(), {row}));
+            println("inserted rows:", 1);
+        } catch (const data_error& e) {
+            println("insert error:", std::string(e.what()));
+        }
+    }
+    // rows from a file in the table format, with the same header
+    void append(string const& filename) {
+        try {
+            query_format_check(!filename.empty(), "append needs a file name");
+            auto tbl = read_table(filename);
+            TablePlayground(tbl).validate();
+            auto const rows = tbl.rows_count();
+            store_.insert(move(tbl));
+            println("inserted rows:", rows);
+        } catch (const data_error& e) {
+            println("insert error:", std::string(e.what()));
+        }
+    }
+    void print_stats() const {
+        // bytes of deferred results are counted once they're written
+        if (pipeline_) {
+            std::cout.flush();
+            pipeline_->drain();
+        }
+        for (auto const& line : metrics_.lines())
+            println("stats:", line);
+        println("stats: cache", cache_);
+        auto const snap = store_.snapshot();
+        i64 delta_rows = 0;
+        for (auto const& delta : snap.deltas)
+            delta_rows += delta->rows_count();
+        println("stats: table version=" + str(snap.version), "main_rows=" + str(snap.main->rows_count()),
+                "delta_segments=" + str(isize(snap.deltas)), "delta_rows=" + str(delta_rows));
+        println("stats: merges done=" + str(store_.merges()), "failed=" + str(store_.failed_merges()));
+        println("stats: reloads done=" + str(store_.reloads()), "failed=" + str(store_.failed_reloads()));
+        if (store_.lazy()) {
+            i64 loaded = 0;
+            for (auto const c : snap.main->columns())
+                loaded += snap.main->loaded(c);
+            println("stats: columns loaded=" + str(loaded) + "/" + str(snap.main->columns_count()),
+                    "loads=" + str(store_.column_loads()), "evictions=" + str(store_.column_evictions()));
+        }
+        if (hw_ && !hw_->available())
+            println("stats: hardware counters unavailable");
+    }
+    void merge() {
+        try {
+            store_.merge();
+        } catch (const data_error& e) {
+            println("table error:", std::string(e.what()));
+        }
+    }
+    void reload(string const& filename) {
+        if (store_.reload(filename))
+            println("reload: started");
+        else
+            println("reload error: another reload is in progress");
+    }
+    void wait_reload() {
+        try {
+            if (store_.wait_reload())
+                println("reload: done, table version", store_.snapshot().version);
+            else
+                println("reload: nothing to wait for");
+        } catch (const data_error& e) {
+            println("reload error:", std::string(e.what()));
+        }
+    }
+    QueryCache const& cache() const noexcept { return cache_; }
+private:
+    // Cached results belong to a particular snapshot, only the default table changes. Loading columns
+    // doesn't change results.
+    Snapshot snapshot_(TableStore& store, indices_t const& columns = {}) {
+        auto snap = store.snapshot(columns);
+        if (&store == &store_ && snap.version != cache_version_) {
+            cache_.clear();
+            cache_version_ = snap.version;
+        }
+        return snap;
+    }
+    // the query bound to a snapshot with the columns it reads loaded
+    std::pair<Snapshot, Query> parse_(TableStore& store, QueryParser& parser, QueryStages& stages) {
+        auto snap = snapshot_(store);
+        auto q = [&] {
+            auto const m = stages.measure(stages.parse);
+            return parse(*snap.main, parser);
+        }();
+        auto const columns = q.columns();
+        if (snap.main->loaded(columns))
+            return {move(snap), move(q)};
+        auto loaded = snapshot_(store, columns);
+        auto bound = q.bind(*loaded.main);
+        return {move(loaded), move(bound)};
+    }
+    std::pair<Snapshot, GroupQuery> parse_group_(TableStore& store, QueryParser& parser, QueryStages& stages) {
+        auto snap = snapshot_(store);
+        auto q = [&] {
+            auto const m = stages.measure(stages.parse);
+            return parse_group(*snap.main, parser);
+        }();
+        auto const columns = q.query.columns();
+        if (snap.main->loaded(columns))
+            return {move(snap), move(q)};
+        auto loaded = snapshot_(store, columns);
+        auto bound = q.bind(*loaded.main);
+        return {move(loaded), move(bound)};
+    }
+    vector<vector<RowNumbers>> select_rows_(Snapshot const& snap, Query const& q, QueryStages& stages,
+            vector<FullscanRequest>* fullscan_requests = nullptr) const {
+        vector<vector<RowNumbers>> res = {TablePlayground(*snap.main).select_rows(q, stages, fullscan_requests)};
+        for (auto const& delta : snap.deltas)
+            res.push_back(TablePlayground(*delta).select_rows(q.bind(*delta), stages));
+        return res;
+    }
+    HwCounters const* hw() const noexcept { return hw_ && hw_->available() ? hw_.get() : nullptr; }
+    string cache_key_(Query const& q, FromClause const& from) const {
+        if (!cache_.enabled())
+            return string();
+        return (catalog_.is_default(from) ? string() : "from " + from.table + " ") + q.normalized();
+    }
+    // joins aren't cached
+    void run_join_(QueryParser& parser, QueryStages& stages) {
+        auto& left_store = catalog_.find(parser.from().table);
+        auto& right_store = catalog_.find(parser.from().joined);
+        auto left = snapshot_(left_store);
+        auto right = snapshot_(right_store);
+        auto const q = [&] {
+            auto parsed = [&] {
+                auto const m = stages.measure(stages.parse);
+                return parse_join(*left.main, *right.main, parser);
+            }();
+            auto left_columns = parsed.left.columns();
+            auto right_columns = parsed.right.columns();
+            for (auto const& [side, c] : parsed.select)
+                (side == 0 ? left_columns : right_columns).push_back(c);
+            if (left.main->loaded(left_columns) && right.main->loaded(right_columns))
+                return parsed;
+            left = snapshot_(left_store, left_columns);
+            right = snapshot_(right_store, right_columns);
+            return JoinQuery{parsed.left.bind(*left.main), parsed.right.bind(*right.main), parsed.key_len,
+                    parsed.select, parsed.header};
+        }();
+        Measure mes(str(++count_));
+        println("query number:", count_);
+        auto const left_rows = select_rows_(left, q.left, stages);
+        auto const right_rows = select_rows_(right, q.right, stages);
+        {
+            auto const m = stages.measure(stages.write);
+            OutputFrame outp(std::cout, format_);
+            stages.write.rows_in += stages.full_scan.rows_out;
+            stages.write.rows_out += merge_join(q, left, left_rows, right, right_rows, outp);
+        }
+        metrics_.record(join_shape, stages, 1);
+    }
+    // grouped queries aren't cached, their output is usually much smaller than the rows
+    void run_group_(QueryParser& parser, QueryStages& stages) {
+        auto const [snap, q] = parse_group_(catalog_.find(parser.from().table), parser, stages);
+        Measure mes(str(++count_));
+        println("query number:", count_);
+        auto const rows = select_rows_(snap, q.query, stages);
+        {
+            auto const m = stages.measure(stages.write);
+            OutputFrame outp(std::cout, format_);
+            stages.write.rows_in += stages.full_scan.rows_out;
+            stages.write.rows_out += write_groups(q, snap, rows, outp);
+        }
+        metrics_.record(group_shape, stages, 1);
+    }
+    void print_(Snapshot const& snap, Query const& q, QueryCache::entry_ptr const& result, QueryStages& stages) const {
+        auto const m = stages.measure(stages.write);
+        for (auto const& segment_rows : result->rows) {
+            for (auto const& r : segment_rows) {
+                stages.write.rows_in += r.count();
+                stages.write.rows_out += r.count();
+            }
+        }
+        if (result->output) {
+            std::cout << *result->output;
+            return;
+        }
+        if (pipeline_) {
+            // the snapshot keeps the tables alive until the writer is done
+            std::cout.flush();
+            pipeline_->defer([snap, q, result, format = format_](std::ostream& os) {
+                OutputFrame outp(os, format);
+                snap.write(q.select_cols, result->rows, outp);
+            });
+            return;
+        }
+        OutputFrame outp(std::cout, format_);
+        snap.write(q.select_cols, result->rows, outp);
+    }
+    void print_fresh_(Snapshot const& snap, Query const& q, string const& key, vector<vector<RowNumbers>> rows,
+            QueryStages& stages) {
+        auto result = std::make_shared<CachedResult>(CachedResult{move(rows), std::nullopt});
+        if (!cache_.enabled()) {
+            print_(snap, q, result, stages);
+            return;
+        }
+        i64 values = 0;
+        for (auto const& segment_rows : result->rows)
+            for (auto const& r : segment_rows)
+                values += r.count() * isize(q.select_cols);
+        if (values <= QueryCache::output_values_limit) {
+            auto const m = stages.measure(stages.write);
+            std::ostringstream os;
+            {
+                OutputFrame outp(os, format_);
+                snap.write(q.select_cols, result->rows, outp);
+            }
+            result->output = os.str();
+        }
+        print_(snap, q, result, stages);
+        cache_.insert(key, move(result));
+    }
+    Catalog const& catalog_;
+    // the default table
+    TableStore& store_;
+    QueryCache cache_;
+    i64 cache_version_ = 0;
+    Metrics metrics_;
+    std::unique_ptr<HwCounters> hw_;
+    // of query results, other responses are text lines
+    OutputFrame::Format const format_;
+    OutputPipeline* pipeline_;
+    i64 count_ = 0;
+};
+struct CmdArgs {
+    // the first table is the default one
+    vstr filenames;
+    bool row_store = false;
+    bool hw_counters = false;
+    i64 cache_bytes = 0;
+    i64 merge_interval = 60;
+    i64 partitions = 0;
+    // columns of tables are mapped from files in this directory
+    string column_dir;
+    bool lazy_columns = false;
+    i64 memory_budget = 0;
+    cnames range_aggregates;
+    bool key_filter = false;
+    MemoryPolicy memory;
+    OutputFrame::Format output_format = OutputFrame::Format::text;
+    bool pipelined_output = false;
+    // set for partition workers, which load only these rows of the table, reading the file from the offset
+    std::optional<RowRange> rows;
+    RowOffset rows_offset;
+    StoreOptions store_options() const {
+        return StoreOptions{row_store, std::chrono::seconds(merge_interval), column_dir, lazy_columns, memory_budget,
+            range_aggregates, key_filter};
+    }
+};
+// Blocks SIGHUP in the calling thread and threads started later, so that SighupReloader gets it.
+sigset_t block_sighup() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    return set;
+}
+// Reloads the table from its file on every SIGHUP, in a thread waiting for the signal.
+class SighupReloader {
+public:
+    SighupReloader(TableStore& store, string filename, sigset_t set) : set_(set) {
+        thread_ = std::thread([this, &store, filename = move(filename)] {
+            int sig = 0;
+            while (sigwait(&set_, &sig) == 0 && !stop_) {
+                if (!store.reload(filename)) {
+                    log_info("SIGHUP ignored, another reload is in progress");
+                }
+            }
+        });
+    }
+    SighupReloader(SighupReloader const&) = delete;
+    SighupReloader& operator=(SighupReloader const&) = delete;
+    ~SighupReloader() {
+        stop_ = true;
+        pthread_kill(thread_.native_handle(), SIGHUP);
+        thread_.join();
+    }
+private:
+    sigset_t const set_;
+    std::atomic<bool> stop_ = false;
+    std::thread thread_;
+};
+// Partition workers print number of rows, first and last key after loading, and end every response
+// with a "done" line.
+constexpr char const* partition_prefix = "partition:";
+constexpr char const* worker_done = "done";
+void print_partition(Table const& tbl) {
+    auto line = str(tbl.rows_count());
+    if (tbl.rows_count() > 0)
+        for (auto const row : {index_t(0), tbl.rows_count() - 1})
+            for (auto const c : tbl.key_columns())
+                line += ' ' + str(tbl.column(c)->at(row));
+    println(string(partition_prefix), line);
+    // the coordinator waits for it
+    std::cout.flush();
+}
+void main_loop(const CmdArgs& args) {
+    auto const sighup = block_sighup();
+    Catalog catalog;
+    cnames aggregated;
+    for (auto const& filename : args.filenames) {
+        auto const file = FileIdentity::of(filename);
+        auto tbl = args.rows ? read_table(filename, *args.rows, std::nullopt, args.rows_offset)
+            : load_table(filename, args.store_options());
+        TablePlayground t(tbl);
+#ifndef NO_VALIDATION
+        try {
+            t.validate(args.rows ? args.rows->l() : 0);
+        } catch (table_error const& exc) {
+            println("table error:", std::string(exc.what()));
+            exit(26);
+        }
+#endif
+        if (args.rows)
+            print_partition(tbl);
+        for (auto const& name : args.range_aggregates)
+            if (tbl.metadata().has_column(name))
+                aggregated.push_back(name);
+        catalog.add(table_name(filename),
+                std::make_unique<TableStore>(move(tbl), filename, args.store_options(), file));
+    }
+    for (auto const& name : args.range_aggregates) {
+        if (!fun::contains(aggregated, name)) {
+            println("table error:", "unknown column in --range-aggregates: " + name);
+            exit(26);
+        }
+    }
+    auto& store = catalog.default_store();
+    // a partition worker keeps only its rows of the file, a reload would replace them with all rows;
+    // SIGHUP stays blocked there
+    std::optional<SighupReloader> reloader;
+    if (!args.rows)
+        reloader.emplace(store, args.filenames.front(), sighup);
+    std::optional<OutputPipeline> pipeline;
+    if (args.pipelined_output)
+        pipeline.emplace(std::cout.rdbuf());
+    CountingStreambuf out(pipeline ? &*pipeline : std::cout.rdbuf());
+    auto const original_out = std::cout.rdbuf(&out);
+    Session session(catalog, args.cache_bytes, out, args.hw_counters, args.output_format,
+            pipeline ? &*pipeline : nullptr);
+    string line;
+    while (std::getline(std::cin, line)) {
+        if (line == batch_begin)
+            session.run_batch(std::cin);
+        else if (line == cache_command)
+            println("cache:", session.cache());
+        else if (line == stats_command)
+            session.print_stats();
+        else if (line.rfind(explain_prefix, 0) == 0)
+            session.explain(line.substr(string_view(explain_prefix).size()));
+        else if (auto const values = command_args(line, insert_command))
+            session.insert(*values);
+        else if (auto const filename = command_args(line, append_command))
+            session.append(*filename);
+        else if (line == merge_command)
+            session.merge();
+        else if (line == reload_command)
+            session.reload(args.filenames.front());
+        else if (line == reload_wait_command)
+            session.wait_reload();
+        else
+            session.run_query(line);
+        if (args.rows)
+            println(string(worker_done));
+        std::cout.flush();
+        // the coordinator waits for the whole response
+        if (args.rows)
+            original_out->pubsync();
+        // the response is handed over to the writer thread
+        if (pipeline)
+            pipeline->pubsync();
+    }
+    std::cout.rdbuf(original_out);
+}
+// }}}
+// partitions {{{
+// Serves the table split into contiguous row ranges, each loaded by a worker process. The file is
+// sorted by key, so partitions are key ranges as well: a query goes only to workers whose range of
+// the first key column it can match, and their results, concatenated in partition order, are in key
+// order.
+class Coordinator {
+public:
+    Coordinator(CmdArgs const& args) : Coordinator(args, scan_table(args.filenames.front())) {}
+    Coordinator(Coordinator const&) = delete;
+    Coordinator& operator=(Coordinator const&) = delete;
+    ~Coordinator() {
+        auto const pids = fun::map(workers_, [](auto const& w) { return w.pid; });
+        // workers exit once their input is closed
+        workers_.clear();
+        for (auto const pid : pids)
+            waitpid(pid, nullptr, 0);
+    }
+    void run_query(string const& line) {
+        try {
+            QueryParser parser(line);
+            query_semantics_check(parser.from().joined.empty()
+                    && (parser.from().table.empty() || parser.from().table == name_),
+                    "only the partitioned table can be queried");
+            query_semantics_check(!parser.grouped(),
+                    "group by, distinct and aggregates aren't supported with --partitions");
+            auto const q = parse(empty_, parser);
+            vector<Worker*> routed;
+            for (auto& w : workers_)
+                if (w.rows > 0 && (w.first_key.empty()
+                        || q.where_pred.first_key_overlaps(w.first_key.front(), w.last_key.front())))
+                    routed.push_back(&w);
+            log_plan("Partitions:", isize(routed), "of", isize(workers_));
+            for (auto const w : routed)
+                w->to << line << std::endl;
+            auto const dead = std::find_if(routed.begin(), routed.end(), [](Worker* w) { return !w->to; });
+            if (dead != routed.end()) {
+                // responses of the other workers are dropped, so that they don't answer the next query
+                string response;
+                for (auto const w : routed)
+                    if (w->to)
+                        while (read_response_(*w, response)) {}
+                table_check(false, "partition worker", (*dead)->pid, "exited");
+            }
+            println("query number:", ++count_);
+            println(fun::join(q.select_cols, ' ', [](auto const& c) { return c.ref().name(); }));
+            for (auto const w : routed) {
+                string response;
+                // the query number and header were printed already
+                for (i64 i = 0; read_response_(*w, response); ++i)
+                    if (i >= 2)
+                        std::cout << response << '\n';
+            }
+        } catch (const data_error& e) {
+            println("query error:", std::string(e.what()));
+        }
+    }
+private:
+    struct Worker {
+        Worker(pid_t pid0, RowRange rows0, int to_fd, int from_fd)
+            : pid(pid0), range(rows0), to_buf(to_fd, std::ios::out), from_buf(from_fd, std::ios::in),
+              to(&to_buf), from(&from_buf) {}
+        pid_t pid;
+        RowRange range;
+        i64 rows = 0;
+        vi64 first_key, last_key;
+        __gnu_cxx::stdio_filebuf<char> to_buf, from_buf;
+        std::ostream to;
+        std::istream from;
+    };
+    // workers start reading the file at offsets found by the scan, near their first rows
+    Coordinator(CmdArgs const& args, ScannedTable const& scanned)
+            : name_(table_name(args.filenames.front())), empty_(Table::from_rows(scanned.md, {})) {
+        auto const rows = scanned.rows;
+        auto const count = std::max<i64>(1, std::min(args.partitions, rows));
+        std::cout.flush();
+        auto const nodes = memory_policy.numa == MemoryPolicy::Numa::partitions ? numa_nodes() : indices_t();
+        for (auto const i : IntRange(0, count)) {
+            RowRange const range(rows * i / count, rows * (i + 1) / count - 1);
+            start_worker_(args, range, scanned.offset_before(range.l()),
+                    nodes.empty() ? std::nullopt : std::optional(nodes[i % isize(nodes)]));
+        }
+        for (auto& w : workers_)
+            read_partition_(w);
+        for (auto const i : IntRange(1, count)) {
+            auto const& prev = workers_[i - 1];
+            auto const& w = workers_[i];
+            table_check(prev.rows == 0 || w.rows == 0 || !vector_less(w.first_key, prev.last_key),
+                    "key of row", w.range.l(), "is lesser than previous row");
+        }
+    }
+    // the worker runs on the node, if given, and its part of the table is allocated there
+    void start_worker_(CmdArgs args, RowRange rows, RowOffset offset, std::optional<index_t> node) {
+        int to[2], from[2];
+        if (pipe(to) != 0 || pipe(from) != 0)
+            throw std::system_error(errno, std::generic_category(), "pipe");
+        auto const pid = fork();
+        if (pid < 0)
+            throw std::system_error(errno, std::generic_category(), "fork");
+        if (pid == 0) {
+            dup2(to[0], STDIN_FILENO);
+            dup2(from[1], STDOUT_FILENO);
+            for (auto const fd : {to[0], to[1], from[0], from[1]})
+                close(fd);
+            // pipes of workers started before
+            workers_.clear();
+            if (node)
+                bind_to_numa_node(*node);
+            args.partitions = 0;
+            args.rows = rows;
+            args.rows_offset = offset;
+            main_loop(args);
+            exit(0);
+        }
+        close(to[0]);
+        close(from[1]);
+        workers_.emplace_back(pid, rows, to[1], from[0]);
+    }
+    void read_partition_(Worker& w) {
+        string line;
+        table_check(std::getline(w.from, line), "partition worker", w.pid, "exited");
+        // otherwise, the worker printed a "table error: ..." line
+        table_check(line.rfind(partition_prefix, 0) == 0, line.substr(line.find(": ") + 2));
+        std::stringstream ss(line.substr(string_view(partition_prefix).size()));
+        ss >> w.rows;
+        auto const key_len = empty_.metadata().key_len();
+        w.first_key.resize(w.rows > 0 ? key_len : 0);
+        w.last_key.resize(w.rows > 0 ? key_len : 0);
+        for (auto& v : w.first_key)
+            ss >> v;
+        for (auto& v : w.last_key)
+            ss >> v;
+    }
+    // false at the end of the response
+    bool read_response_(Worker& w, string& line) {
+        table_check(std::getline(w.from, line), "partition worker", w.pid, "exited");
+        return line != worker_done;
+    }
+    string const name_;
+    Table const empty_;
+    // std::deque, so that streams of started workers don't move
+    std::deque<Worker> workers_;
+    i64 count_ = 0;
+};
+void coordinator_loop(CmdArgs const& args) {
+    // reloads aren't supported with partitions, a SIGHUP sent to the process group mustn't kill it
+    signal(SIGHUP, SIG_IGN);
+    // writes to exited workers fail instead, see Coordinator::run_query()
+    signal(SIGPIPE, SIG_IGN);
+    std::unique_ptr<Coordinator> coordinator;
+    try {
+        coordinator = std::make_unique<Coordinator>(args);
+    } catch (table_error const& exc) {
+        println("table error:", std::string(exc.what()));
+        exit(26);
+    }
+    string line;
+    while (std::getline(std::cin, line)) {
+        coordinator->run_query(line);
+        std::cout.flush();
+    }
+}
+// }}}
+// cmdline {{{
+void quit([[maybe_unused]] std::string msg) {
+    log_info(msg, "- exiting");
+    exit(13);
+}
+constexpr char const* usage = "usage: plantydb [--row-store] [--cache-size=BYTES] [--hw-counters] "
+    "[--merge-interval=SECONDS] [--partitions=N] [--column-dir=DIR] [--lazy-columns] [--memory-budget=BYTES] "
+    "[--huge-pages=transparent|hugetlb] [--numa=interleave|partitions] [--output=binary] [--pipelined-output] "
+    "[--range-aggregates=COLUMN,...] [--key-filter] path-to-csv-file [more-csv-files...]";
+// parses "--name=VALUE" into value, if arg is that option
+bool numeric_option(string const& arg, string const& name, i64& value) {
+    if (arg.rfind(name + "=", 0) != 0)
+        return false;
+    auto const [res, is_ok] = to_i64(arg.substr(name.size() + 1));
+    if (!is_ok || res < 0)
+        quit("bad value of " + name + ": " + arg);
+    value = res;
+    return true;
+}
+CmdArgs validate(int argc, char** argv) {
+    CmdArgs args;
+    for (auto const i : IntRange(1, argc)) {
+        string const arg(argv[i]);
+        if (arg == "--row-store") {
+            args.row_store = true;
+        } else if (arg == "--hw-counters") {
+            args.hw_counters = true;
+        } else if (arg == "--lazy-columns") {
+            args.lazy_columns = true;
+        } else if (arg == "--huge-pages=transparent") {
+            args.memory.huge_pages = MemoryPolicy::HugePages::transparent;
+        } else if (arg == "--huge-pages=hugetlb") {
+            args.memory.huge_pages = MemoryPolicy::HugePages::hugetlb;
+        } else if (arg == "--key-filter") {
+            args.key_filter = true;
+        } else if (arg == "--pipelined-output") {
+            args.pipelined_output = true;
+        } else if (arg == "--output=binary") {
+            args.output_format = OutputFrame::Format::binary;
+        } else if (arg == "--numa=interleave") {
+            args.memory.numa = MemoryPolicy::Numa::interleave;
+        } else if (arg == "--numa=partitions") {
+            args.memory.numa = MemoryPolicy::Numa::partitions;
+        } else if (arg.rfind("--column-dir=", 0) == 0) {
+            args.column_dir = arg.substr(string_view("--column-dir=").size());
+        } else if (arg.rfind("--range-aggregates=", 0) == 0) {
+            std::stringstream ss(arg.substr(string_view("--range-aggregates=").size()));
+            for (string name; std::getline(ss, name, ',');)
+                args.range_aggregates.push_back(name);
+        } else if (numeric_option(arg, "--cache-size", args.cache_bytes)
+                || numeric_option(arg, "--merge-interval", args.merge_interval)
+                || numeric_option(arg, "--partitions", args.partitions)
+                || numeric_option(arg, "--memory-budget", args.memory_budget)) {
+            continue;
+        } else if (!arg.empty() && arg.front() != '-') {
+            for (auto const& filename : args.filenames)
+                if (table_name(filename) == table_name(arg))
+                    quit("duplicate table name: " + table_name(arg));
+            args.filenames.push_back(arg);
+        } else {
+            quit("unknown argument: " + arg + "; " + usage);
+        }
+    }
+    if (args.filenames.empty())
+        quit(usage);
+    if (args.partitions > 0 && isize(args.filenames) > 1)
+        quit("--partitions supports only one table");
+    if (!args.column_dir.empty() && (args.row_store || args.partitions > 0))
+        quit("--column-dir can't be combined with --row-store or --partitions");
+    if (args.lazy_columns && (args.row_store || args.partitions > 0 || !args.column_dir.empty()))
+        quit("--lazy-columns can't be combined with --row-store, --partitions or --column-dir");
+    if (!args.range_aggregates.empty() && args.lazy_columns)
+        quit("--range-aggregates can't be combined with --lazy-columns");
+    if (args.memory_budget > 0 && !args.lazy_columns)
+        quit("--memory-budget requires --lazy-columns");
+    if (args.memory.numa == MemoryPolicy::Numa::partitions && args.partitions == 0)
+        quit("--numa=partitions requires --partitions");
+    if (args.output_format == OutputFrame::Format::binary && args.partitions > 0)
+        quit("--output=binary can't be combined with --partitions");
+    if (args.pipelined_output && args.partitions > 0)
+        quit("--pipelined-output can't be combined with --partitions");
+    return args;
+}
+// counts allocations for the "stats" command
+void* operator new(std::size_t size) {
+    count_allocation();
+    if (auto const p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+    count_allocation();
+    return std::malloc(size ? size : 1);
+}
+// kept out of line: once inlined, gcc pairs free() with the operator new call and warns of a mismatch
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::nothrow_t const&) noexcept { std::free(p); }
+// bench.cc includes this file with NO_MAIN to reuse the engine
+#ifndef NO_MAIN
+int main(int argc, char** argv) {
+    auto const args = validate(argc, argv);
+    memory_policy = args.memory;
+    if (args.partitions > 0)
+        coordinator_loop(args);
+    else
+        main_loop(args);
+}
+#endif
 // }}}